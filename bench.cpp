@@ -0,0 +1,315 @@
+// Benchmark of the search engines over a corpus of puzzles, from the
+// built-in six-piece box to pentomino boards. Prints one JSON object per
+// puzzle and engine with the wall time, the search rates and the peak memory
+// of the run, each run in a child process of its own where fork() exists.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "parallel.h"
+#include "puzzle.h"
+#include "search.h"
+
+// The corpus after the built-in puzzle, in the format read by PuzzleReader
+const char *kCorpus = R"(
+puzzle soma-3x3x3
+box 3 3 3
+piece V 0,0,0 1,0,0 0,1,0
+piece L 0,0,0 1,0,0 2,0,0 0,1,0
+piece T 0,0,0 1,0,0 2,0,0 1,1,0
+piece Z 0,0,0 1,0,0 1,1,0 2,1,0
+piece A 0,0,0 1,0,0 0,1,0 0,1,1
+piece B 0,0,0 1,0,0 0,1,0 1,0,1
+piece P 0,0,0 1,0,0 0,1,0 0,0,1
+
+puzzle pentacubes-2x3x10
+box 10 3 2
+piece I 0,0,0 1,0,0 2,0,0 3,0,0 4,0,0
+piece L 0,0,0 1,0,0 2,0,0 3,0,0 0,1,0
+piece Y 0,0,0 1,0,0 2,0,0 3,0,0 1,1,0
+piece N 0,0,0 1,0,0 1,1,0 2,1,0 3,1,0
+piece P 0,0,0 1,0,0 2,0,0 0,1,0 1,1,0
+piece T 0,0,0 1,0,0 2,0,0 1,1,0 1,2,0
+piece U 0,0,0 0,1,0 1,1,0 2,1,0 2,0,0
+piece V 0,0,0 1,0,0 2,0,0 2,1,0 2,2,0
+piece W 0,0,0 1,0,0 1,1,0 2,1,0 2,2,0
+piece X 1,0,0 0,1,0 1,1,0 2,1,0 1,2,0
+piece Z 0,0,0 1,0,0 1,1,0 1,2,0 2,2,0
+piece F 1,0,0 0,1,0 1,1,0 2,1,0 2,2,0
+
+puzzle pentominoes-3x20
+box 20 3 1
+piece I 0,0,0 1,0,0 2,0,0 3,0,0 4,0,0
+piece L 0,0,0 1,0,0 2,0,0 3,0,0 0,1,0
+piece Y 0,0,0 1,0,0 2,0,0 3,0,0 1,1,0
+piece N 0,0,0 1,0,0 1,1,0 2,1,0 3,1,0
+piece P 0,0,0 1,0,0 2,0,0 0,1,0 1,1,0
+piece T 0,0,0 1,0,0 2,0,0 1,1,0 1,2,0
+piece U 0,0,0 0,1,0 1,1,0 2,1,0 2,0,0
+piece V 0,0,0 1,0,0 2,0,0 2,1,0 2,2,0
+piece W 0,0,0 1,0,0 1,1,0 2,1,0 2,2,0
+piece X 1,0,0 0,1,0 1,1,0 2,1,0 1,2,0
+piece Z 0,0,0 1,0,0 1,1,0 1,2,0 2,2,0
+piece F 1,0,0 0,1,0 1,1,0 2,1,0 2,2,0
+
+puzzle pentominoes-4x15
+box 15 4 1
+piece I 0,0,0 1,0,0 2,0,0 3,0,0 4,0,0
+piece L 0,0,0 1,0,0 2,0,0 3,0,0 0,1,0
+piece Y 0,0,0 1,0,0 2,0,0 3,0,0 1,1,0
+piece N 0,0,0 1,0,0 1,1,0 2,1,0 3,1,0
+piece P 0,0,0 1,0,0 2,0,0 0,1,0 1,1,0
+piece T 0,0,0 1,0,0 2,0,0 1,1,0 1,2,0
+piece U 0,0,0 0,1,0 1,1,0 2,1,0 2,0,0
+piece V 0,0,0 1,0,0 2,0,0 2,1,0 2,2,0
+piece W 0,0,0 1,0,0 1,1,0 2,1,0 2,2,0
+piece X 1,0,0 0,1,0 1,1,0 2,1,0 1,2,0
+piece Z 0,0,0 1,0,0 1,1,0 1,2,0 2,2,0
+piece F 1,0,0 0,1,0 1,1,0 2,1,0 2,2,0
+
+puzzle pentominoes-5x12
+box 12 5 1
+piece I 0,0,0 1,0,0 2,0,0 3,0,0 4,0,0
+piece L 0,0,0 1,0,0 2,0,0 3,0,0 0,1,0
+piece Y 0,0,0 1,0,0 2,0,0 3,0,0 1,1,0
+piece N 0,0,0 1,0,0 1,1,0 2,1,0 3,1,0
+piece P 0,0,0 1,0,0 2,0,0 0,1,0 1,1,0
+piece T 0,0,0 1,0,0 2,0,0 1,1,0 1,2,0
+piece U 0,0,0 0,1,0 1,1,0 2,1,0 2,0,0
+piece V 0,0,0 1,0,0 2,0,0 2,1,0 2,2,0
+piece W 0,0,0 1,0,0 1,1,0 2,1,0 2,2,0
+piece X 1,0,0 0,1,0 1,1,0 2,1,0 1,2,0
+piece Z 0,0,0 1,0,0 1,1,0 1,2,0 2,2,0
+piece F 1,0,0 0,1,0 1,1,0 2,1,0 2,2,0
+
+puzzle pentominoes-6x10
+box 10 6 1
+piece I 0,0,0 1,0,0 2,0,0 3,0,0 4,0,0
+piece L 0,0,0 1,0,0 2,0,0 3,0,0 0,1,0
+piece Y 0,0,0 1,0,0 2,0,0 3,0,0 1,1,0
+piece N 0,0,0 1,0,0 1,1,0 2,1,0 3,1,0
+piece P 0,0,0 1,0,0 2,0,0 0,1,0 1,1,0
+piece T 0,0,0 1,0,0 2,0,0 1,1,0 1,2,0
+piece U 0,0,0 0,1,0 1,1,0 2,1,0 2,0,0
+piece V 0,0,0 1,0,0 2,0,0 2,1,0 2,2,0
+piece W 0,0,0 1,0,0 1,1,0 2,1,0 2,2,0
+piece X 1,0,0 0,1,0 1,1,0 2,1,0 1,2,0
+piece Z 0,0,0 1,0,0 1,1,0 1,2,0 2,2,0
+piece F 1,0,0 0,1,0 1,1,0 2,1,0 2,2,0
+)";
+
+// Puzzles only run with --full, they take minutes
+const char *kFullCorpus = R"(
+puzzle pentacubes-2x5x6
+box 6 5 2
+piece I 0,0,0 1,0,0 2,0,0 3,0,0 4,0,0
+piece L 0,0,0 1,0,0 2,0,0 3,0,0 0,1,0
+piece Y 0,0,0 1,0,0 2,0,0 3,0,0 1,1,0
+piece N 0,0,0 1,0,0 1,1,0 2,1,0 3,1,0
+piece P 0,0,0 1,0,0 2,0,0 0,1,0 1,1,0
+piece T 0,0,0 1,0,0 2,0,0 1,1,0 1,2,0
+piece U 0,0,0 0,1,0 1,1,0 2,1,0 2,0,0
+piece V 0,0,0 1,0,0 2,0,0 2,1,0 2,2,0
+piece W 0,0,0 1,0,0 1,1,0 2,1,0 2,2,0
+piece X 1,0,0 0,1,0 1,1,0 2,1,0 1,2,0
+piece Z 0,0,0 1,0,0 1,1,0 1,2,0 2,2,0
+piece F 1,0,0 0,1,0 1,1,0 2,1,0 2,2,0
+)";
+
+// Call run in a child process and return what it returns, with peakRssKb set
+// to the peak resident set size of the child in KiB. Each run then gets its
+// own high-water mark instead of the one of every run before it. Without
+// fork() run is called in this process and peakRssKb is 0, for unknown.
+// Returns an empty string if the child failed.
+std::string runInChild(const std::function<std::string()> &run,
+                       long &peakRssKb) {
+  peakRssKb = 0;
+#if defined(__unix__) || defined(__APPLE__)
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return "";
+  }
+  std::cout << std::flush;
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    std::string output = run();
+    for (size_t done = 0; done < output.size();) {
+      ssize_t n = write(fds[1], output.data() + done, output.size() - done);
+      if (n <= 0) {
+        _exit(1);
+      }
+      done += n;
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+  std::string output;
+  char buffer[4096];
+  for (ssize_t n; pid > 0 && (n = read(fds[0], buffer, sizeof(buffer))) > 0;) {
+    output.append(buffer, n);
+  }
+  close(fds[0]);
+  int status;
+  rusage usage;
+  if (pid < 0 || wait4(pid, &status, 0, &usage) != pid ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return "";
+  }
+#if defined(__APPLE__)
+  peakRssKb = usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+  peakRssKb = usage.ru_maxrss;
+#endif
+  return output;
+#else
+  return run();
+#endif
+}
+
+struct BenchResult {
+  uint64_t solutions;
+  SearchStats stats;
+  double seconds;
+};
+
+// Count the solutions of puzzle in its own box with engine, on an
+// Occupancy<N>
+template <int N>
+BenchResult runBenchInBox(const Puzzle &puzzle, const std::string &engine,
+                          int numThreads) {
+  std::vector<PieceOrients> pieceOrients = puzzleOrients(puzzle, puzzle.size);
+  Box<N> box(puzzle.size.x, puzzle.size.y, puzzle.size.z);
+  box.block(puzzle.blocked);
+  PlacementTable<N> table = buildPlacementTable(box, pieceOrients);
+  SearchContext<N> ctx{&table};
+  SolutionSink<N> sink(0);
+  BenchResult result;
+  auto startTime = std::chrono::steady_clock::now();
+  searchWithEngine(engine, box, ctx, numThreads, 2, sink, result.stats);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - startTime;
+  result.seconds = elapsed.count();
+  result.solutions = sink.count;
+  return result;
+}
+
+// runBenchInBox with the narrowest occupancy that holds the box
+BenchResult runBench(const Puzzle &puzzle, const std::string &engine,
+                     int numThreads) {
+  const Size &size = puzzle.size;
+  BenchResult result;
+  withOccupancy(size.x * size.y * size.z, [&](auto words) {
+    result = runBenchInBox<decltype(words)::value>(puzzle, engine, numThreads);
+  });
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::string> engines;
+  std::vector<std::string> names;
+  int numThreads = 1;
+  bool full = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--engine" && i + 1 < argc) {
+      engines.push_back(argv[++i]);
+    } else if (arg == "--puzzle" && i + 1 < argc) {
+      names.push_back(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      char rest;
+      if (std::sscanf(argv[++i], "%d%c", &numThreads, &rest) != 1) {
+        std::cerr << "Invalid number of threads: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "--full") {
+      full = true;
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--engine backtrack|iterative|dlx]..."
+                   " [--puzzle NAME]... [--threads N (0: all cores)]"
+                   " [--full]"
+                << std::endl;
+      return 1;
+    }
+  }
+  if (engines.empty()) {
+    engines = {"backtrack", "iterative", "dlx"};
+  }
+  for (const auto &engine : engines) {
+    if (engine != "backtrack" && engine != "iterative" && engine != "dlx") {
+      std::cerr << "Unknown engine: " << engine << std::endl;
+      return 1;
+    }
+  }
+  if (numThreads <= 0) {
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  std::vector<Puzzle> corpus = {builtinPuzzle()};
+  corpus[0].name = "six-piece-4x4x2";
+  std::istringstream text(std::string(kCorpus) + (full ? kFullCorpus : ""));
+  PuzzleReader reader(text);
+  for (Puzzle puzzle; reader.next(puzzle);) {
+    corpus.push_back(puzzle);
+  }
+  if (!reader.error().empty()) {
+    std::cerr << "Corpus: " << reader.error() << std::endl;
+    return 1;
+  }
+
+  std::cout << "[" << std::endl;
+  bool first = true;
+  for (const auto &puzzle : corpus) {
+    if (!names.empty() &&
+        std::find(names.begin(), names.end(), puzzle.name) == names.end()) {
+      continue;
+    }
+    for (const auto &engine : engines) {
+      // Only the backtrack engine runs in parallel
+      int threads = engine == "backtrack" ? numThreads : 1;
+      long peakRssKb;
+      std::string fields = runInChild(
+          [&] {
+            BenchResult r = runBench(puzzle, engine, threads);
+            // A run too short for the clock has no rates
+            double perSecond = r.seconds > 0 ? 1 / r.seconds : 0;
+            std::ostringstream out;
+            out << ", \"solutions\": " << r.solutions
+                << ", \"nodes\": " << r.stats.nodes
+                << ", \"seconds\": " << r.seconds
+                << ", \"nodes_per_second\": " << r.stats.nodes * perSecond
+                << ", \"solutions_per_second\": " << r.solutions * perSecond;
+#if defined(PACK_INSTRUMENT)
+            out << ", \"depths\": ";
+            writeDepthStatsJson(out, r.stats);
+#endif
+            return out.str();
+          },
+          peakRssKb);
+      if (fields.empty()) {
+        std::cerr << "The run of " << puzzle.name << " with " << engine
+                  << " failed" << std::endl;
+        return 1;
+      }
+      std::cout << (first ? "" : ",\n") << "  {\"puzzle\": \"" << puzzle.name
+                << "\", \"engine\": \"" << engine
+                << "\", \"threads\": " << threads << fields
+                << ", \"peak_rss_kb\": " << peakRssKb << "}" << std::flush;
+      first = false;
+    }
+  }
+  std::cout << (first ? "" : "\n") << "]" << std::endl;
+}
@@ -0,0 +1,642 @@
+#pragma once
+
+#include <bitset>
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "piece.h"
+
+struct Position {
+  int x;
+  int y;
+  int z;
+  friend std::ostream &operator<<(std::ostream &os, const Position &pos) {
+    os << "(" << pos.x << ", " << pos.y << ", " << pos.z << ")";
+    return os;
+  }
+};
+
+// One word of cells, one bit per cell
+using Bitboard = uint64_t;
+
+// Index of the lowest set bit, bits must not be 0
+inline int lowestBit(Bitboard bits) {
+  assert(bits);
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward64(&index, bits);
+  return index;
+#else
+  return __builtin_ctzll(bits);
+#endif
+}
+
+// Number of set bits
+inline int popCount(Bitboard bits) {
+#if defined(_MSC_VER)
+  return __popcnt64(bits);
+#else
+  return __builtin_popcountll(bits);
+#endif
+}
+
+// Index of the lowest clear bit of a bitset of numWords words, -1 if every
+// bit is set. Walks the words from the lowest, one bit scan on the first one
+// that is not full.
+inline int lowestClearBit(const uint64_t *words, int numWords) {
+  for (int i = 0; i < numWords; ++i) {
+    if (~words[i]) {
+      return 64 * i + lowestBit(~words[i]);
+    }
+  }
+  return -1;
+}
+
+// Occupancy of a box of up to 64 * N cells, one bit per cell in N words.
+// Every operation is a loop over the words with a fixed trip count, which the
+// compiler unrolls and vectorises, so Occupancy<1> is a single register.
+template <int N> struct Occupancy {
+  static constexpr int kNumCells = 64 * N;
+  Bitboard words[N] = {};
+
+  // The set of the single cell
+  static Occupancy bit(int cell) {
+    Occupancy result;
+    result.words[cell / 64] = Bitboard{1} << cell % 64;
+    return result;
+  }
+  // The set of cells 0 to numCells - 1
+  static Occupancy firstCells(int numCells) {
+    Occupancy result;
+    for (int i = 0; i < N; ++i) {
+      int n = numCells - 64 * i;
+      result.words[i] = n >= 64 ? ~Bitboard{0}
+                        : n > 0 ? (Bitboard{1} << n) - 1
+                                : 0;
+    }
+    return result;
+  }
+
+  bool test(int cell) const { return words[cell / 64] >> cell % 64 & 1; }
+  void set(int cell) { words[cell / 64] |= Bitboard{1} << cell % 64; }
+
+  // Remove the lowest cell, as bits &= bits - 1 does on a word
+  void clearLowestBit() {
+    if constexpr (N == 1) {
+      words[0] &= words[0] - 1;
+    } else {
+      for (int i = 0; i < N; ++i) {
+        if (words[i]) {
+          words[i] &= words[i] - 1;
+          return;
+        }
+      }
+    }
+  }
+
+  explicit operator bool() const {
+    Bitboard any = 0;
+    for (int i = 0; i < N; ++i) {
+      any |= words[i];
+    }
+    return any;
+  }
+
+  Occupancy &operator&=(const Occupancy &other) {
+    for (int i = 0; i < N; ++i) {
+      words[i] &= other.words[i];
+    }
+    return *this;
+  }
+  Occupancy &operator|=(const Occupancy &other) {
+    for (int i = 0; i < N; ++i) {
+      words[i] |= other.words[i];
+    }
+    return *this;
+  }
+  Occupancy &operator^=(const Occupancy &other) {
+    for (int i = 0; i < N; ++i) {
+      words[i] ^= other.words[i];
+    }
+    return *this;
+  }
+  Occupancy operator~() const {
+    Occupancy result;
+    for (int i = 0; i < N; ++i) {
+      result.words[i] = ~words[i];
+    }
+    return result;
+  }
+  friend Occupancy operator&(Occupancy a, const Occupancy &b) { return a &= b; }
+  friend Occupancy operator|(Occupancy a, const Occupancy &b) { return a |= b; }
+  friend Occupancy operator^(Occupancy a, const Occupancy &b) { return a ^= b; }
+
+  friend bool operator==(const Occupancy &a, const Occupancy &b) {
+    for (int i = 0; i < N; ++i) {
+      if (a.words[i] != b.words[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+  friend bool operator!=(const Occupancy &a, const Occupancy &b) {
+    return !(a == b);
+  }
+  // Ordered as numbers of 64 * N bits
+  friend bool operator<(const Occupancy &a, const Occupancy &b) {
+    for (int i = N - 1; i >= 0; --i) {
+      if (a.words[i] != b.words[i]) {
+        return a.words[i] < b.words[i];
+      }
+    }
+    return false;
+  }
+
+  uint64_t hash() const {
+    uint64_t h = words[0];
+    for (int i = 1; i < N; ++i) {
+      h = (h ^ (h >> 29) ^ words[i]) * 0x9e3779b97f4a7c15;
+    }
+    return h;
+  }
+};
+
+namespace std {
+template <int N> struct hash<Occupancy<N>> {
+  size_t operator()(const Occupancy<N> &bits) const { return bits.hash(); }
+};
+} // namespace std
+
+// Index of the lowest set cell, bits must not be empty
+template <int N> int lowestBit(const Occupancy<N> &bits) {
+  for (int i = 0; i < N - 1; ++i) {
+    if (bits.words[i]) {
+      return 64 * i + lowestBit(bits.words[i]);
+    }
+  }
+  return 64 * (N - 1) + lowestBit(bits.words[N - 1]);
+}
+
+template <int N> int popCount(const Occupancy<N> &bits) {
+  int count = 0;
+  for (int i = 0; i < N; ++i) {
+    count += popCount(bits.words[i]);
+  }
+  return count;
+}
+
+// The largest box, in cells, and the occupancy holding any box
+constexpr int kMaxWords = 8;
+constexpr int kMaxCells = 64 * kMaxWords;
+using CellSet = Occupancy<kMaxWords>;
+
+// Call f(std::integral_constant<int, N>()) with the fewest words N, out of
+// 1, 2, 4 and 8, whose Occupancy<N> holds numCells cells, to run the code
+// instantiated for that width. numCells must not be above kMaxCells.
+template <typename F> void withOccupancy(int numCells, F &&f) {
+  assert(numCells <= kMaxCells);
+  if (numCells <= 64) {
+    f(std::integral_constant<int, 1>());
+  } else if (numCells <= 128) {
+    f(std::integral_constant<int, 2>());
+  } else if (numCells <= 256) {
+    f(std::integral_constant<int, 4>());
+  } else {
+    f(std::integral_constant<int, 8>());
+  }
+}
+
+// A set of pieces, bit i stands for the i-th piece of the piece list
+using PieceMask = uint64_t;
+
+// Test n masks, at most 64, against occupied at once: bit i of the result is
+// set if masks[i] covers no occupied cell. Free of branches on the masks, so
+// the search does not mispredict on every placement that does not fit.
+inline uint64_t fitMaskScalar(const Bitboard *masks, int n,
+                              Bitboard occupied) {
+  uint64_t fits = 0;
+  for (int i = 0; i < n; ++i) {
+    fits |= uint64_t((masks[i] & occupied) == 0) << i;
+  }
+  return fits;
+}
+
+#if defined(__x86_64__) && !defined(_MSC_VER)
+// fitMaskScalar four masks at a time
+__attribute__((target("avx2"))) inline uint64_t
+fitMaskAvx2(const Bitboard *masks, int n, Bitboard occupied) {
+  const __m256i occ = _mm256_set1_epi64x(occupied);
+  const __m256i zero = _mm256_setzero_si256();
+  uint64_t fits = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i m =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(masks + i));
+    __m256i fit = _mm256_cmpeq_epi64(_mm256_and_si256(m, occ), zero);
+    fits |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(fit))) << i;
+  }
+  if (i < n) {
+    fits |= fitMaskScalar(masks + i, n - i, occupied) << i;
+  }
+  return fits;
+}
+#endif
+
+// fitMaskScalar with the widest version the CPU supports, picked on first use
+inline uint64_t fitMask(const Bitboard *masks, int n, Bitboard occupied) {
+  using Fit = uint64_t (*)(const Bitboard *, int, Bitboard);
+#if defined(__x86_64__) && !defined(_MSC_VER)
+  static const Fit fit =
+      __builtin_cpu_supports("avx2") ? fitMaskAvx2 : fitMaskScalar;
+#else
+  static const Fit fit = fitMaskScalar;
+#endif
+  return fit(masks, n, occupied);
+}
+
+// A piece orientation at a fixed offset in the box
+template <int N> struct Placement {
+  Occupancy<N> mask;   // The cells covered by the placement
+  int piece;           // Index of the piece in the piece list
+  const Piece *orient; // The orientation being placed
+  Position pos;
+  // Raw solutions that each solution through this placement stands for,
+  // above 1 only in a table restricted by a BoxSymmetry
+  uint32_t weight = 1;
+};
+
+template <int N> struct PiecePos {
+  const Piece *piece;
+  Position pos;
+  Occupancy<N> mask; // The cells covered by the piece
+  int pieceIndex;    // Index of the piece in the piece list, -1 if unknown
+};
+
+// The order the search fills the cells of a box in
+enum class CellOrder {
+  Scan,   // x-y-z scan, z first
+  Snake,  // x-y-z scan, turning back at the end of every row and layer
+  Layers, // z-x-y scan, one z layer after another
+};
+
+// The cell of a box at each position of order, as an x-y-z scan index
+inline std::vector<int> cellSequence(CellOrder order, int x, int y, int z) {
+  std::vector<int> cells;
+  auto scanIndex = [&](int i, int j, int k) { return (i * y + j) * z + k; };
+  if (order == CellOrder::Layers) {
+    for (int k = 0; k < z; ++k) {
+      for (int i = 0; i < x; ++i) {
+        for (int j = 0; j < y; ++j) {
+          cells.push_back(scanIndex(i, j, k));
+        }
+      }
+    }
+    return cells;
+  }
+  int row = 0;
+  for (int i = 0; i < x; ++i) {
+    for (int jj = 0; jj < y; ++jj, ++row) {
+      bool snake = order == CellOrder::Snake;
+      int j = snake && i % 2 ? y - 1 - jj : jj;
+      for (int kk = 0; kk < z; ++kk) {
+        cells.push_back(scanIndex(i, j, snake && row % 2 ? z - 1 - kk : kk));
+      }
+    }
+  }
+  return cells;
+}
+
+// A box a 3D space with integer coordinates, maintain the occupied cells as
+// an Occupancy<N>. Bit i is the i-th cell of the box's CellOrder, so the
+// lowest clear bit is the first empty cell.
+template <int N> struct Box {
+  using Board = Occupancy<N>;
+
+  int x;
+  int y;
+  int z;
+  Box(int x, int y, int z, CellOrder order = CellOrder::Scan)
+      : x(x), y(y), z(z) {
+    assert(x * y * z <= Board::kNumCells);
+    pieces.reserve(x * y * z);
+    if (order != CellOrder::Scan) {
+      auto layout = std::make_shared<CellLayout>();
+      layout->cellOfBit = cellSequence(order, x, y, z);
+      layout->bitOfCell.resize(x * y * z);
+      for (int bit = 0; bit < x * y * z; ++bit) {
+        layout->bitOfCell[layout->cellOfBit[bit]] = bit;
+      }
+      layout_ = std::move(layout);
+    }
+  }
+  Board occupied;
+  // Cells outside the target shape, occupied from the start
+  Board blocked;
+
+  // Block cells, given in x-y-z scan order like Puzzle::blocked whatever the
+  // order of the box
+  template <int M> void block(Occupancy<M> cells) {
+    for (; cells; cells.clearLowestBit()) {
+      blocked.set(bitOfScanIndex(lowestBit(cells)));
+    }
+    occupied |= blocked;
+  }
+
+  int cellIndex(int x, int y, int z) const {
+    return bitOfScanIndex((x * this->y + y) * this->z + z);
+  }
+  Position cellPosition(int index) const {
+    if (layout_) {
+      index = layout_->cellOfBit[index];
+    }
+    return {index / (this->y * this->z), index / this->z % this->y,
+            index % this->z};
+  }
+
+  // Whether bit i is the i-th cell of the x-y-z scan
+  bool hasScanOrder() const { return !layout_; }
+
+  // Index of the first empty cell, -1 if the box is full
+  int firstEmptyCell() const {
+    int cell = lowestClearBit(occupied.words, N);
+    return cell < x * y * z ? cell : -1;
+  }
+
+  Board cellBit(int x, int y, int z) const {
+    return Board::bit(cellIndex(x, y, z));
+  }
+  bool isOccupied(int x, int y, int z) const {
+    return occupied.test(cellIndex(x, y, z));
+  }
+
+  bool hasDupIDPiece() const {
+    std::bitset<256> has;
+    for (int i = 0; i < pieces.size(); ++i) {
+      unsigned char id = pieces[i].piece->id_;
+      if (has[id]) {
+        return true;
+      }
+      has[id] = true;
+    }
+    return false;
+  }
+
+  bool isOutOfBound(const Position &pos) const {
+    return pos.x < 0 || pos.x >= x || pos.y < 0 || pos.y >= y || pos.z < 0 ||
+           pos.z >= z;
+  }
+
+  // Mask of the cells covered by the piece at pos, 0 if it does not fit in
+  // the box. Only the bounding box needs a bounds check.
+  Board pieceMask(const Piece &piece, const Position &pos) const {
+    Board mask;
+    if (isOutOfBound(pos) ||
+        isOutOfBound({pos.x + piece.size_.x - 1, pos.y + piece.size_.y - 1,
+                      pos.z + piece.size_.z - 1})) {
+      return mask;
+    }
+    for (const auto &p : piece) {
+      mask.set(cellIndex(pos.x + p.x, pos.y + p.y, pos.z + p.z));
+    }
+    return mask;
+  }
+
+  bool canPush(const Board &mask) const {
+    return mask && !(occupied & mask);
+  }
+
+  void pushPiece(const Piece &piece, const Position &pos, const Board &mask,
+                 int pieceIndex = -1) {
+    assert(canPush(mask));
+    occupied |= mask;
+    pieces.push_back({&piece, pos, mask, pieceIndex});
+  }
+  void pushPiece(const Placement<N> &p) {
+    pushPiece(*p.orient, p.pos, p.mask, p.piece);
+  }
+
+  bool tryPushPieceTo(const Piece &piece, const Position &pos) {
+    Board mask = pieceMask(piece, pos);
+    if (!canPush(mask)) {
+      return false;
+    }
+    pushPiece(piece, pos, mask);
+    return true;
+  }
+
+  std::pair<bool, Position> tryPushOriendtedPiece(const Piece &piece) {
+    for (int x = 0; x < this->x - piece.size_.x + 1; ++x) {
+      for (int y = 0; y < this->y - piece.size_.y + 1; ++y) {
+        for (int z = 0; z < this->z - piece.size_.z + 1; ++z) {
+          if (tryPushPieceTo(piece, {x, y, z})) {
+            return {true, {x, y, z}};
+          }
+        }
+      }
+    }
+    return {false, {0, 0, 0}};
+  }
+
+  std::pair<bool, Position> tryPushPiece(const PieceOrients &pieceOrients) {
+    for (const auto &p : pieceOrients) {
+      auto [success, pos] = tryPushOriendtedPiece(p);
+      if (success) {
+        return {true, pos};
+      }
+    }
+    return {false, {0, 0, 0}};
+  }
+
+  void popPiece() {
+    assert((occupied & pieces.back().mask) == pieces.back().mask);
+    occupied ^= pieces.back().mask;
+    pieces.pop_back();
+  }
+
+  // The piece ID of every cell, indexed by x + y * X + z * X * Y. Only used
+  // for rendering, the search itself works on the bitboard.
+  std::vector<PieceID> pieceGrid() const {
+    std::vector<PieceID> grid(x * y * z, NONE);
+    for (Board bits = blocked; bits; bits.clearLowestBit()) {
+      Position p = cellPosition(lowestBit(bits));
+      grid[p.x + p.y * x + p.z * x * y] = ' ';
+    }
+    for (const auto &piece : pieces) {
+      for (const auto &p : *piece.piece) {
+        grid[(piece.pos.x + p.x) + (piece.pos.y + p.y) * x +
+             (piece.pos.z + p.z) * x * y] = piece.piece->id_;
+      }
+    }
+    return grid;
+  }
+
+  void printVisualize(std::ostream &os) const {
+    std::vector<PieceID> grid = pieceGrid();
+    for (int x = 0; x < this->x; ++x) {
+      for (int z = 0; z < this->z; ++z) {
+        for (int y = 0; y < this->y; ++y) {
+          os << grid[x + y * this->x + z * this->x * this->y];
+        }
+        os << "  ";
+      }
+      os << std::endl;
+    }
+    os << std::endl;
+  }
+  
+  std::vector<PiecePos<N>> pieces;
+
+private:
+  // The cells of a box in an order other than the x-y-z scan
+  struct CellLayout {
+    std::vector<int> bitOfCell; // By x-y-z scan index
+    std::vector<int> cellOfBit;
+  };
+
+  int bitOfScanIndex(int index) const {
+    return layout_ ? layout_->bitOfCell[index] : index;
+  }
+
+  // Shared by the copies of the box, none for the x-y-z scan
+  std::shared_ptr<const CellLayout> layout_;
+
+public:
+
+  // Output to ostream
+  friend std::ostream &operator<<(std::ostream &os, const Box &box) {
+    os << "Box: [" << box.x << ", " << box.y << ", " << box.z
+       << "], pieces: " << box.pieces.size() << std::endl;
+    for (const auto &p : box.pieces) {
+      os << "  Pos (" << p.pos.x << ", " << p.pos.y << ", " << p.pos.z << ") "
+         << *p.piece << std::endl;
+    }
+    box.printVisualize(os);
+    return os;
+  }
+};
+
+// Every in-bounds placement of every piece, grouped by anchor cell (the
+// first cell of the placement in the order of the box) and then by piece,
+// stored in one flat array. The placements of piece i anchored at cell c are
+// [begin(c, i), end(c, i)).
+template <int N> struct PlacementTable {
+  int numPieces = 0;
+  std::vector<int> volumes; // Number of cells of each piece
+  std::vector<Placement<N>> placements;
+  // Word w of the mask of each placement, by w, for fitMask
+  std::vector<Bitboard> masks[N];
+  std::vector<int> start; // Offset of each (cell, piece) group, plus the end
+  // Bit i is set if piece i is a copy of piece i - 1. Copies are placed in
+  // order, so that each packing is found once and not once per permutation.
+  PieceMask copies = 0;
+
+  const Placement<N> *begin(int cell, int piece) const {
+    return placements.data() + start[cell * numPieces + piece];
+  }
+  const Placement<N> *end(int cell, int piece) const {
+    return placements.data() + start[cell * numPieces + piece + 1];
+  }
+
+  // The placements anchored at cell, the groups of all its pieces in order
+  int cellBegin(int cell) const { return start[cell * numPieces]; }
+  int cellEnd(int cell) const { return start[(cell + 1) * numPieces]; }
+
+  // Number of placements anchored at cell of the pieces in mask
+  int numPlacements(int cell, PieceMask mask) const {
+    int n = 0;
+    for (; mask; mask &= mask - 1) {
+      n += end(cell, lowestBit(mask)) - begin(cell, lowestBit(mask));
+    }
+    return n;
+  }
+
+  // Bit i is set if placement first + i fits in occupied, for i below n,
+  // n at most 64. Words of occupied with no cell taken rule nothing out.
+  uint64_t fitting(int first, int n, const Occupancy<N> &occupied) const {
+    uint64_t fits = n == 64 ? ~uint64_t{0} : (uint64_t{1} << n) - 1;
+    for (int w = 0; w < N; ++w) {
+      if (occupied.words[w]) {
+        fits &= fitMask(&masks[w][first], n, occupied.words[w]);
+      }
+    }
+    return fits;
+  }
+
+  // Set masks once all placements are added
+  void finish() {
+    for (int w = 0; w < N; ++w) {
+      masks[w].clear();
+      for (const Placement<N> &p : placements) {
+        masks[w].push_back(p.mask.words[w]);
+      }
+    }
+  }
+
+  PieceMask allPieces() const {
+    return numPieces == 64 ? ~PieceMask{0} : (PieceMask{1} << numPieces) - 1;
+  }
+
+  // The pieces of remaining that may be placed next: not a copy whose
+  // previous copy is still remaining
+  PieceMask placeable(PieceMask remaining) const {
+    return remaining & ~(remaining << 1 & copies);
+  }
+};
+
+// Precompute all placements of the pieces in the free cells of the box. A
+// placement is anchored at its first cell in the order of the box, the one
+// it must cover when that cell is the first empty one. Consecutive pieces
+// with the same orientations are copies.
+template <int N>
+PlacementTable<N> buildPlacementTable(const Box<N> &box,
+                                      const std::vector<PieceOrients> &pieces) {
+  PlacementTable<N> table;
+  assert(pieces.size() <= 64);
+  table.numPieces = pieces.size();
+  for (const auto &orients : pieces) {
+    // A piece without any orientation that fits has no placements either
+    table.volumes.push_back(orients.empty() ? 0 : orients.front().numCells());
+  }
+  for (int i = 1; i < pieces.size(); ++i) {
+    if (pieces[i] == pieces[i - 1] &&
+        (pieces[i].empty() || pieces[i][0].id_ == pieces[i - 1][0].id_)) {
+      table.copies |= PieceMask{1} << i;
+    }
+  }
+  int numCells = box.x * box.y * box.z;
+  std::vector<std::vector<Placement<N>>> groups(numCells * pieces.size());
+  for (int i = 0; i < pieces.size(); ++i) {
+    for (const auto &p : pieces[i]) {
+      for (int x = 0; x + p.size_.x <= box.x; ++x) {
+        for (int y = 0; y + p.size_.y <= box.y; ++y) {
+          for (int z = 0; z + p.size_.z <= box.z; ++z) {
+            Occupancy<N> mask = box.pieceMask(p, {x, y, z});
+            if (mask && !(mask & box.occupied)) {
+              groups[lowestBit(mask) * pieces.size() + i].push_back(
+                  {mask, i, &p, {x, y, z}});
+            }
+          }
+        }
+      }
+    }
+  }
+  for (const auto &group : groups) {
+    table.start.push_back(table.placements.size());
+    table.placements.insert(table.placements.end(), group.begin(),
+                            group.end());
+  }
+  table.start.push_back(table.placements.size());
+  table.finish();
+  return table;
+}
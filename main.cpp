@@ -1,425 +1,642 @@
 #include <algorithm>
-#include <cassert>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
-#include <ostream>
-#include <set>
-#include <utility>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-enum PieceID { NONE, A, B, C, D, E, F };
-const char *PieceNames[] = {".", "A", "B", "C", "D", "E", "F"};
-
-// A point is a (x, y, z) coordinate
-struct Point {
-  int x;
-  int y;
-  int z;
-  bool operator<(const Point &rhs) const {
-    return x < rhs.x || (x == rhs.x && y < rhs.y) ||
-           (x == rhs.x && y == rhs.y && z < rhs.z);
-  }
-  bool operator==(const Point &rhs) const {
-    return x == rhs.x && y == rhs.y && z == rhs.z;
-  }
-};
-struct Size {
-  int x;
-  int y;
-  int z;
+#include "parallel.h"
+#include "puzzle.h"
+#include "search.h"
+#include "store.h"
+
+// Largest --cache, 2^32 slots
+constexpr int kMaxCacheBits = 32;
+
+// The command line options that control the search
+struct Options {
+  std::string engine = "backtrack";
+  int numThreads = 1;
+  int splitDepth = 2;
+  bool countOnly = false;
+  bool stopAtFirst = false;
+  bool printAll = false;
+  bool useSymmetry = false;
+  bool usePruning = false;
+  bool printStats = false;
+  std::string branching = "first";
+  CellOrder cellOrder = CellOrder::Scan;
+  int cacheBits = 0;
+  int estimateProbes = 0; // Random probes to estimate the search with
+  bool estimateOnly = false;
+  double progressInterval = 0; // Seconds between progress lines, 0 for none
+  std::vector<Size> boxSizes; // Boxes to pack instead of the puzzle's own
+  std::string saveFile;       // Solution file to append the solutions to
 };
 
-// A piece is a set of points
-class Piece {
+// Print the progress of a search to std::cerr every interval seconds until
+// destroyed, with the time left extrapolated from the time taken so far
+class ProgressReporter {
 public:
-  Piece(PieceID id, std::initializer_list<Point> points)
-      : id_{id}, points_(points) {
-    normalize();
+  ProgressReporter(const Progress &progress, double interval)
+      : progress_(progress), interval_(interval),
+        thread_([this] { report(); }) {}
+
+  ~ProgressReporter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
   }
 
-  // Rotate the piece 90 degrees clockwise around the z-axis
-  Piece &rotateZ() {
-    std::vector<Point> new_points;
-    for (const auto &p : points_) {
-      new_points.push_back({p.y, -p.x, p.z});
+private:
+  void report() {
+    auto startTime = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!wake_.wait_for(lock, std::chrono::duration<double>(interval_),
+                           [this] { return done_; })) {
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - startTime;
+      double fraction = progress_.fraction();
+      std::cerr << "Progress " << 100 * fraction << "% after "
+                << elapsed.count() << " s, ";
+      if (fraction > 0) {
+        std::cerr << "ETA " << elapsed.count() * (1 - fraction) / fraction
+                  << " s" << std::endl;
+      } else {
+        std::cerr << "no ETA yet" << std::endl;
+      }
     }
-    points_ = new_points;
-    return this->normalize();
   }
 
-  // Rotate the piece 90 degrees clockwise around the x-axis
-  Piece &rotateX() {
-    std::vector<Point> new_points;
-    for (const auto &p : points_) {
-      new_points.push_back({p.x, p.z, -p.y});
+  const Progress &progress_;
+  double interval_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool done_ = false;
+  std::thread thread_;
+};
+
+// Pack the pieces of puzzle into a box of the given size, which has the
+// puzzle's blocked cells, and print the results to out. Searches on an
+// Occupancy<N>, wide enough for the box. Returns false if the --cache table
+// cannot be allocated.
+template <int N>
+bool solveInBox(const Puzzle &puzzle, const Size &boxSize,
+                const Options &options, std::ostream &out) {
+  std::vector<PieceOrients> pieceOrients = puzzleOrients(puzzle, boxSize);
+
+  // Dump all pieces
+  // for (const auto &s : pieceOrients) {
+  //   std::cout << "Piece set: " << s.size() << std::endl;
+  //   for (const auto &p : s) {
+  //     std::cout << "  " << p << std::endl;
+  //   }
+  // }
+
+  // Search for solutions
+  Box<N> box(boxSize.x, boxSize.y, boxSize.z, options.cellOrder);
+  box.block(puzzle.blocked);
+  PlacementTable<N> table = buildPlacementTable(box, pieceOrients);
+  std::optional<BoxSymmetry<N>> symmetry;
+  if (options.useSymmetry) {
+    symmetry.emplace(box, table);
+  }
+  const BoxSymmetry<N> *sym = symmetry ? &*symmetry : nullptr;
+  std::optional<SolutionWriter<N>> writer;
+  if (!options.saveFile.empty()) {
+    writer.emplace(puzzle, box, table, pieceOrients, sym);
+    if (!writer->open(options.saveFile)) {
+      out << "Cannot save the solutions: " << writer->error() << std::endl;
+      return true;
     }
-    points_ = new_points;
-    return this->normalize();
   }
-
-  // Rotate the piece 90 degrees clockwise around the y-axis
-  Piece &rotateY() {
-    std::vector<Point> new_points;
-    for (const auto &p : points_) {
-      new_points.push_back({p.z, p.y, -p.x});
+  if (symmetry) {
+    table = symmetry->restrict(table);
+  }
+  std::optional<RegionPruner<N>> pruner;
+  if (options.usePruning) {
+    pruner.emplace(box, table);
+  }
+  SearchContext<N> ctx{&table, pruner ? &*pruner : nullptr};
+  if (options.branching == "constrained") {
+    ctx.candidates.emplace(box, table);
+  }
+  std::unique_ptr<TranspositionTable<N>> cache;
+  if (options.cacheBits) {
+    try {
+      cache = std::make_unique<TranspositionTable<N>>(options.cacheBits);
+    } catch (const std::bad_alloc &) {
+      std::cerr << "Cannot allocate the cache of 2^" << options.cacheBits
+                << " slots" << std::endl;
+      return false;
+    }
+    ctx.cache = cache.get();
+  }
+  int numThreads = options.numThreads;
+  int splitDepth = options.splitDepth;
+
+  if (options.estimateProbes) {
+    TreeEstimate estimate = estimateTree(ctx, box, options.estimateProbes);
+    out << "Estimated " << estimate.nodes << " nodes, " << estimate.solutions
+        << " solutions and " << estimate.seconds << " s from "
+        << options.estimateProbes << " probes" << std::endl;
+    if (options.estimateOnly) {
+      return true;
     }
-    points_ = new_points;
-    return this->normalize();
   }
 
-  // Normalize the piece, so that the first point is at (0, 0, 0)
-  // Also update the bounding box size
-  // And sort the points
-  Piece &normalize() {
-    int min_x = 0;
-    int min_y = 0;
-    int min_z = 0;
-    for (const auto &p : points_) {
-      min_x = std::min(min_x, p.x);
-      min_y = std::min(min_y, p.y);
-      min_z = std::min(min_z, p.z);
+  // Run the selected engine, reporting every solution to visit
+  SearchStats stats;
+  Progress progress;
+  std::optional<ProgressReporter> reporter;
+  if (options.progressInterval > 0) {
+    reporter.emplace(progress, options.progressInterval);
+  }
+  auto solve = [&](auto &visit) {
+    return searchWithEngine(options.engine, box, ctx, numThreads, splitDepth,
+                            visit, stats, reporter ? &progress : nullptr);
+  };
+  auto startTime = std::chrono::steady_clock::now();
+
+  if (cache) {
+    // Count only, solved subtrees are not searched again
+    uint64_t count;
+    if (numThreads > 1) {
+      ParallelSolver<N> solver(box, ctx, numThreads, splitDepth);
+      count = solver.count();
+      stats = solver.stats();
+    } else {
+      count = countSolutions(ctx, table.allPieces(), box);
+      stats = ctx.stats;
     }
-    for (auto &p : points_) {
-      p.x -= min_x;
-      p.y -= min_y;
-      p.z -= min_z;
+    out << "Found " << count << " solutions" << std::endl;
+  } else if (writer) {
+    // Append the solutions to the solution file as they are found
+    uint64_t count = 0;
+    auto save = [&](const Box<N> &box) {
+      count += sym ? sym->weight(box) : 1;
+      if (!sym || sym->isCanonical(box)) {
+        writer->add(box);
+      }
+      return true;
+    };
+    solve(save);
+    out << "Found " << count << " solutions, saved " << writer->count()
+        << " to " << options.saveFile << std::endl;
+    if (!writer->close()) {
+      out << "Cannot save the solutions: " << writer->error() << std::endl;
     }
-    // Update the bounding box size
-    size_.x = 0;
-    size_.y = 0;
-    size_.z = 0;
-    for (const auto &p : points_) {
-      size_.x = std::max(size_.x, p.x + 1);
-      size_.y = std::max(size_.y, p.y + 1);
-      size_.z = std::max(size_.z, p.z + 1);
+  } else if (options.printAll || options.stopAtFirst) {
+    // Stream the solutions out as they are found
+    uint64_t count = 0;
+    auto print = [&](const Box<N> &box) {
+      count += sym ? sym->weight(box) : 1;
+      if (sym && !sym->isCanonical(box)) {
+        return true;
+      }
+      out << box;
+      return !options.stopAtFirst;
+    };
+    bool finished = solve(print);
+    out << (finished ? "Found " : "Stopped after ") << count << " solutions"
+        << std::endl;
+  } else {
+    SolutionSink<N> sink(options.countOnly ? 0 : 1, sym);
+    solve(sink);
+    out << "Found " << sink.count << " solutions";
+    if (sym) {
+      out << ", " << sink.distinct << " distinct up to rotation";
+    }
+    out << std::endl;
+    if (!sink.solutions.empty()) {
+      out << sink.solutions[0];
     }
-    // Sort the points
-    std::sort(points_.begin(), points_.end());
-    return *this;
   }
+  if (options.printStats) {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - startTime;
+    out << "Searched " << stats.nodes << " nodes in " << elapsed.count()
+        << " s, " << stats.regionPrunes << " cut by region pruning, "
+        << stats.cellPrunes << " by uncoverable cells, " << stats.cacheHits
+        << " subtrees from the cache" << std::endl;
+#if defined(PACK_INSTRUMENT)
+    printDepthStats(out, stats);
+#endif
+  }
+  return true;
+}
 
-  // Check if two pieces are equal
-  bool operator==(const Piece &rhs) const { return points_ == rhs.points_; }
+// solveInBox with the narrowest occupancy that holds the box
+bool solvePuzzle(const Puzzle &puzzle, const Size &boxSize,
+                 const Options &options, std::ostream &out) {
+  int free = boxSize.x * boxSize.y * boxSize.z - popCount(puzzle.blocked);
+  if (free != puzzle.volume()) {
+    out << "The pieces cover " << puzzle.volume() << " cells, not " << free
+        << std::endl;
+    return true;
+  }
+  bool solved;
+  withOccupancy(boxSize.x * boxSize.y * boxSize.z, [&](auto words) {
+    solved = solveInBox<decltype(words)::value>(puzzle, boxSize, options, out);
+  });
+  return solved;
+}
 
-  // Print to ostream
-  friend std::ostream &operator<<(std::ostream &os, const Piece &piece) {
-    os << "ID: " << PieceNames[piece.id_] << ", size: [" << piece.size_.x
-       << ", " << piece.size_.y << ", " << piece.size_.z << "], points: [ ";
-    for (const auto &p : piece.points_) {
-      os << "(" << p.x << ", " << p.y << ", " << p.z << ") ";
+// Solve puzzle, the index-th one read, in each box of options, with a
+// header line for each. Returns false, without trying further boxes, if
+// one could not be searched.
+bool solveJob(const Puzzle &puzzle, int index, bool fromFile,
+              const Options &options, std::ostream &out) {
+  if (fromFile) {
+    out << "Puzzle "
+        << (puzzle.name.empty() ? std::to_string(index) : puzzle.name)
+        << std::endl;
+  }
+  const std::vector<Size> &boxSizes = options.boxSizes;
+  if (boxSizes.empty()) {
+    return solvePuzzle(puzzle, puzzle.size, options, out);
+  }
+  for (const Size &boxSize : boxSizes) {
+    if (boxSizes.size() > 1) {
+      out << "Box " << boxSize.x << "x" << boxSize.y << "x" << boxSize.z
+          << std::endl;
+    }
+    if (puzzle.blocked) {
+      out << "--box does not apply to a target shape" << std::endl;
+      continue;
+    }
+    if (!solvePuzzle(puzzle, boxSize, options, out)) {
+      return false;
     }
-    os << "]";
-    return os;
   }
+  return true;
+}
 
-  // Compare two pieces
-  bool operator<(const Piece &rhs) const { return points_ < rhs.points_; }
-
-  PieceID id_;
-  std::vector<Point> points_;
-  Size size_; // The size of the bounding box
-};
-
-// PieceSet is all possible orientations of a piece
-using PieceOrients = std::set<Piece>;
-using PieceOrientsPtr = std::set<Piece> *;
-
-// Generate all 24 rotations of a piece
-// (6 different x-axis orientation * 4 different rotations around the x-axis)
-PieceOrients allRotations(Piece p) {
-  // clang-format off
-  PieceOrients result;
-
-  // 1st orientation, toward positive x-axis
-  result.insert(p);
-  p.rotateX(); result.insert(p);
-  p.rotateX(); result.insert(p);
-  p.rotateX(); result.insert(p);
-  // 2nd orientation, toward positive y-axis
-  p.rotateZ(); result.insert(p);
-  p.rotateY(); result.insert(p);
-  p.rotateY(); result.insert(p);
-  p.rotateY(); result.insert(p);
-  // 3rd orientation, toward negative x-axis
-  p.rotateZ(); result.insert(p);
-  p.rotateX(); result.insert(p);
-  p.rotateX(); result.insert(p);
-  p.rotateX(); result.insert(p);
-  // 4th orientation, toward negative y-axis
-  p.rotateZ(); result.insert(p);
-  p.rotateY(); result.insert(p);
-  p.rotateY(); result.insert(p);
-  p.rotateY(); result.insert(p);
-  // 5th orientation, toward positive z-axis
-  p.rotateX(); result.insert(p);
-  p.rotateZ(); result.insert(p);
-  p.rotateZ(); result.insert(p);
-  p.rotateZ(); result.insert(p);
-  // 6th orientation, toward negative z-axis
-  p.rotateX().rotateX(); result.insert(p);
-  p.rotateZ(); result.insert(p);
-  p.rotateZ(); result.insert(p);
-  p.rotateZ(); result.insert(p);
-  // clang-format on
-
-  // The box has height 2, so we can filter out some pieces with height > 2
-  PieceOrients filtered;
-  for (const auto &p : result) {
-    if (p.size_.z <= 2) {
-      filtered.insert(p);
+// Solve the puzzles of reader concurrently, one puzzle per task on a pool of
+// options.numThreads workers, each puzzle searched by a single thread. The
+// results are printed in input order as soon as all earlier ones are done.
+// Returns the number of puzzles solved, and sets ok to whether all of them
+// could be searched.
+int solveBatch(PuzzleReader &reader, const Options &options,
+               OrientationCache &cache, bool &ok) {
+  Options jobOptions = options;
+  jobOptions.numThreads = 1;
+  WorkStealingPool pool(options.numThreads);
+  // Bound the puzzles read ahead of the printed ones
+  const int maxPending = 4 * options.numThreads;
+  std::mutex mutex;
+  std::condition_variable printed;
+  std::unordered_map<int, std::string> results;
+  int nextToPrint = 1;
+  std::atomic<bool> failed{false};
+
+  int index = 1;
+  for (Puzzle puzzle; reader.next(puzzle); ++index) {
+    cache.attach(puzzle);
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      printed.wait(lock, [&] { return index - nextToPrint < maxPending; });
     }
+    pool.submit([&, puzzle, index](int) {
+      std::ostringstream out;
+      if (!solveJob(puzzle, index, true, jobOptions, out)) {
+        failed = true;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      results[index] = out.str();
+      for (auto it = results.find(nextToPrint); it != results.end();
+           it = results.find(nextToPrint)) {
+        std::cout << it->second << std::flush;
+        results.erase(it);
+        ++nextToPrint;
+      }
+      printed.notify_all();
+    });
   }
-
-  return filtered;
+  pool.wait();
+  ok = !failed;
+  return index - 1;
 }
 
-struct Position {
-  int x;
-  int y;
-  int z;
-  friend std::ostream &operator<<(std::ostream &os, const Position &pos) {
-    os << "(" << pos.x << ", " << pos.y << ", " << pos.z << ")";
-    return os;
+// Number of puzzles in the file at path, counting no further than limit
+int countPuzzles(const std::string &path, int limit) {
+  std::ifstream file(path, std::ios::binary);
+  PuzzleReader reader(file);
+  int count = 0;
+  for (Puzzle puzzle; count < limit && reader.next(puzzle);) {
+    ++count;
   }
-};
-
-struct PiecePos {
-  const Piece *piece;
-  Position pos;
-};
+  return count;
+}
 
-// A box a 3D space with integer coordinates, maintain a 3D array of bools
-struct Box {
-  int x;
-  int y;
-  int z;
-  Box(int x, int y, int z) : x(x), y(y), z(z) {
-    data.resize(x * y * z);
-    for (int i = 0; i < x * y * z; ++i) {
-      data[i] = NONE;
-    }
-  }
-  std::vector<PieceID> data;
-  bool isOccupied(int x, int y, int z) const {
-    return data[x + y * this->x + z * this->x * this->y];
+// Print the number of solutions in the solution file at path and the first of
+// them, or all of them with --print. Returns the exit status.
+int printSolutionFile(const std::string &path, const Options &options) {
+  SolutionStore store;
+  if (!store.open(path)) {
+    std::cerr << path << ": " << store.error() << std::endl;
+    return 1;
   }
-  void setOccupied(int x, int y, int z, PieceID id) {
-    data[x + y * this->x + z * this->x * this->y] = id;
+  const Puzzle &puzzle = store.puzzle();
+  const Size &size = puzzle.size;
+  if (!puzzle.name.empty()) {
+    std::cout << "Puzzle " << puzzle.name << std::endl;
   }
-  void clearOccupied(int x, int y, int z) {
-    data[x + y * this->x + z * this->x * this->y] = NONE;
+  std::cout << "Loaded " << store.size() << " solutions";
+  if (store.symmetryOrder()) {
+    std::cout << ", distinct up to the " << store.symmetryOrder()
+              << " rotations of the box";
   }
-
-  bool hasDupIDPiece() const {
-    bool has[7] = {false};
-    for (int i = 0; i < pieces.size(); ++i) {
-      if (has[pieces[i].piece->id_]) {
-        return true;
+  std::cout << std::endl;
+  uint64_t numPrinted = options.printAll ? store.size()
+                                         : std::min<uint64_t>(1, store.size());
+  int status = 0;
+  withOccupancy(size.x * size.y * size.z, [&](auto words) {
+    constexpr int N = decltype(words)::value;
+    Box<N> empty(size.x, size.y, size.z);
+    empty.block(puzzle.blocked);
+    for (uint64_t i = 0; i < numPrinted; ++i) {
+      Box<N> box = empty;
+      if (!store.decode(i, box)) {
+        std::cerr << path << ": bad solution " << i << std::endl;
+        status = 1;
+        return;
       }
-      has[pieces[i].piece->id_] = true;
+      std::cout << box;
     }
-    return false;
-  }
+  });
+  return status;
+}
 
-  bool isOutOfBound(const Position &pos) const {
-    return pos.x < 0 || pos.x >= x || pos.y < 0 || pos.y >= y || pos.z < 0 ||
-           pos.z >= z;
-  }
+// Parse the whole of text as a number, false if it is not one
+bool parseNumber(const char *text, int &value) {
+  char rest;
+  return std::sscanf(text, "%d%c", &value, &rest) == 1;
+}
 
-  bool tryPushPieceTo(const Piece &piece, const Position &pos) {
-    for (const auto &p : piece.points_) {
-      if (isOutOfBound({pos.x + p.x, pos.y + p.y, pos.z + p.z})) {
-        return false;
+bool parseNumber(const char *text, double &value) {
+  char rest;
+  return std::sscanf(text, "%lf%c", &value, &rest) == 1;
+}
+
+// Print the command line options, returns the exit status of a bad one
+int printUsage(const char *program) {
+  std::cerr << "Usage: " << program
+            << " [--engine backtrack|iterative|dlx]"
+               " [--threads N (0: all cores)]"
+               " [--split-depth D] [--count | --first | --print]"
+               " [--symmetry] [--prune] [--branch first|constrained]"
+               " [--order scan|snake|layers]"
+               " [--cache LOG2_SLOTS (1-32)] [--stats] [--box XxYxZ]..."
+               " [--estimate[-only] PROBES] [--progress SECONDS]"
+               " [--puzzle FILE [--write-binary FILE | --batch]]"
+               " [--save FILE] [--load FILE]"
+            << std::endl;
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  std::vector<Size> &boxSizes = options.boxSizes;
+  bool batch = false;
+  std::string puzzleFile;
+  std::string binaryFile;
+  std::string loadFile;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--engine" && i + 1 < argc) {
+      options.engine = argv[++i];
+    } else if (arg == "--threads" && i + 1 < argc) {
+      if (!parseNumber(argv[++i], options.numThreads)) {
+        return printUsage(argv[0]);
       }
-      if (isOccupied(pos.x + p.x, pos.y + p.y, pos.z + p.z)) {
-        return false;
+    } else if (arg == "--split-depth" && i + 1 < argc) {
+      if (!parseNumber(argv[++i], options.splitDepth)) {
+        return printUsage(argv[0]);
       }
-    }
-    for (const auto &p : piece.points_) {
-      setOccupied(pos.x + p.x, pos.y + p.y, pos.z + p.z, piece.id_);
-    }
-    pieces.push_back({&piece, pos});
-    return true;
-  }
-
-  std::pair<bool, Position> tryPushOriendtedPiece(const Piece &piece) {
-    for (int x = 0; x < this->x - piece.size_.x + 1; ++x) {
-      for (int y = 0; y < this->y - piece.size_.y + 1; ++y) {
-        for (int z = 0; z < this->z - piece.size_.z + 1; ++z) {
-          if (tryPushPieceTo(piece, {x, y, z})) {
-            return {true, {x, y, z}};
-          }
-        }
+    } else if (arg == "--count") {
+      options.countOnly = true;
+    } else if (arg == "--first") {
+      options.stopAtFirst = true;
+    } else if (arg == "--print") {
+      options.printAll = true;
+    } else if (arg == "--symmetry") {
+      options.useSymmetry = true;
+    } else if (arg == "--prune") {
+      options.usePruning = true;
+    } else if (arg == "--stats") {
+      options.printStats = true;
+    } else if (arg == "--branch" && i + 1 < argc) {
+      options.branching = argv[++i];
+    } else if (arg == "--order" && i + 1 < argc) {
+      std::string order = argv[++i];
+      if (order == "scan") {
+        options.cellOrder = CellOrder::Scan;
+      } else if (order == "snake") {
+        options.cellOrder = CellOrder::Snake;
+      } else if (order == "layers") {
+        options.cellOrder = CellOrder::Layers;
+      } else {
+        std::cerr << "Unknown cell order: " << order << std::endl;
+        return 1;
       }
+    } else if (arg == "--cache" && i + 1 < argc) {
+      if (!parseNumber(argv[++i], options.cacheBits) || options.cacheBits < 1 ||
+          options.cacheBits > kMaxCacheBits) {
+        return printUsage(argv[0]);
+      }
+    } else if ((arg == "--estimate" || arg == "--estimate-only") &&
+               i + 1 < argc) {
+      if (!parseNumber(argv[++i], options.estimateProbes)) {
+        return printUsage(argv[0]);
+      }
+      options.estimateOnly = arg == "--estimate-only";
+    } else if (arg == "--progress" && i + 1 < argc) {
+      if (!parseNumber(argv[++i], options.progressInterval)) {
+        return printUsage(argv[0]);
+      }
+    } else if (arg == "--box" && i + 1 < argc) {
+      Size size;
+      char rest;
+      if (std::sscanf(argv[++i], "%dx%dx%d%c", &size.x, &size.y, &size.z,
+                      &rest) != 3 ||
+          size.x <= 0 || size.y <= 0 || size.z <= 0) {
+        std::cerr << "Invalid box size: " << argv[i] << std::endl;
+        return 1;
+      }
+      if (size.x * size.y * size.z > kMaxCells) {
+        std::cerr << "Boxes over " << kMaxCells
+                  << " cells are not supported: " << argv[i] << std::endl;
+        return 1;
+      }
+      boxSizes.push_back(size);
+    } else if (arg == "--puzzle" && i + 1 < argc) {
+      puzzleFile = argv[++i];
+    } else if (arg == "--write-binary" && i + 1 < argc) {
+      binaryFile = argv[++i];
+    } else if (arg == "--batch") {
+      batch = true;
+    } else if (arg == "--save" && i + 1 < argc) {
+      options.saveFile = argv[++i];
+    } else if (arg == "--load" && i + 1 < argc) {
+      loadFile = argv[++i];
+    } else {
+      return printUsage(argv[0]);
     }
-    return {false, {0, 0, 0}};
   }
-
-  std::pair<bool, Position> tryPushPiece(const PieceOrients &pieceOrients) {
-    for (const auto &p : pieceOrients) {
-      auto [success, pos] = tryPushOriendtedPiece(p);
-      if (success) {
-        return {true, pos};
-      }
+  if (options.numThreads <= 0) {
+    options.numThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  const std::string &engine = options.engine;
+  if (engine != "backtrack" && engine != "iterative" && engine != "dlx") {
+    std::cerr << "Unknown engine: " << engine << std::endl;
+    return 1;
+  }
+  if (options.branching != "first" && options.branching != "constrained") {
+    std::cerr << "Unknown branching: " << options.branching << std::endl;
+    return 1;
+  }
+  if (options.branching == "constrained" && engine != "backtrack") {
+    std::cerr << "--branch constrained needs the backtrack engine" << std::endl;
+    return 1;
+  }
+  // --batch runs a puzzle per thread, each on any engine
+  if (options.numThreads > 1 && engine != "backtrack" && !batch) {
+    std::cerr << "--threads above 1 needs the backtrack engine or --batch"
+              << std::endl;
+    return 1;
+  }
+  if (options.usePruning && engine == "dlx") {
+    std::cerr << "--prune needs the backtrack or iterative engine"
+              << std::endl;
+    return 1;
+  }
+  if (options.cacheBits &&
+      (engine != "backtrack" || options.printAll || options.stopAtFirst)) {
+    std::cerr << "--cache only counts solutions, with the backtrack engine"
+              << std::endl;
+    return 1;
+  }
+  if (options.progressInterval > 0 &&
+      (engine != "backtrack" || options.cacheBits || batch)) {
+    std::cerr << "--progress needs the backtrack engine, without --cache or"
+                 " --batch"
+              << std::endl;
+    return 1;
+  }
+  // The estimate probes and times the first empty cell search of one thread
+  if (options.estimateProbes &&
+      (engine != "backtrack" || options.branching != "first" ||
+       options.cacheBits)) {
+    std::cerr << "--estimate needs the backtrack engine, without --branch"
+                 " constrained or --cache"
+              << std::endl;
+    return 1;
+  }
+  if (!binaryFile.empty() && puzzleFile.empty()) {
+    std::cerr << "--write-binary converts the puzzles of --puzzle"
+              << std::endl;
+    return 1;
+  }
+  if (batch && (puzzleFile.empty() || !binaryFile.empty())) {
+    std::cerr << "--batch solves the puzzles of --puzzle" << std::endl;
+    return 1;
+  }
+  if (!options.saveFile.empty() &&
+      (options.cacheBits || options.countOnly || options.printAll ||
+       options.stopAtFirst || batch || !binaryFile.empty())) {
+    std::cerr << "--save stores every solution, without --cache, --count,"
+                 " --print, --first, --batch or --write-binary"
+              << std::endl;
+    return 1;
+  }
+  // A solution file holds a single puzzle, solved in a single box
+  if (!options.saveFile.empty() &&
+      (boxSizes.size() > 1 ||
+       (!puzzleFile.empty() && countPuzzles(puzzleFile, 2) > 1))) {
+    std::cerr << "--save stores the solutions of one puzzle in one box"
+              << std::endl;
+    return 1;
+  }
+  if (!loadFile.empty()) {
+    if (!puzzleFile.empty() || !options.saveFile.empty()) {
+      std::cerr << "--load prints the solutions of a solution file"
+                << std::endl;
+      return 1;
     }
-    return {false, {0, 0, 0}};
+    return printSolutionFile(loadFile, options);
   }
 
-  void popPiece() {
-    const auto &piece = pieces.back();
-    for (const auto &p : piece.piece->points_) {
-      assert(
-          isOccupied(piece.pos.x + p.x, piece.pos.y + p.y, piece.pos.z + p.z));
-      clearOccupied(piece.pos.x + p.x, piece.pos.y + p.y, piece.pos.z + p.z);
+  // Without --puzzle, solve the built-in puzzle
+  std::ifstream file;
+  std::optional<PuzzleReader> reader;
+  if (!puzzleFile.empty()) {
+    file.open(puzzleFile, std::ios::binary);
+    if (!file) {
+      std::cerr << "Cannot open " << puzzleFile << std::endl;
+      return 1;
     }
-    pieces.pop_back();
+    reader.emplace(file);
+  }
+  std::ofstream binary;
+  if (!binaryFile.empty()) {
+    binary.open(binaryFile, std::ios::binary);
+    binary.write(kPuzzleMagic, sizeof(kPuzzleMagic));
   }
 
-  void printVisualize(std::ostream &os) const {
-    for (int x = 0; x < this->x; ++x) {
-      for (int z = 0; z < this->z; ++z) {
-        for (int y = 0; y < this->y; ++y) {
-          os << PieceNames[data[x + y * this->x + z * this->x * this->y]];
-        }
-        os << "  ";
-      }
-      os << std::endl;
+  OrientationCache cache;
+  if (batch) {
+    auto startTime = std::chrono::steady_clock::now();
+    bool ok;
+    int solved = solveBatch(*reader, options, cache, ok);
+    if (options.printStats) {
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - startTime;
+      std::cout << "Solved " << solved << " puzzles in " << elapsed.count()
+                << " s, " << solved / elapsed.count() << " puzzles/s"
+                << std::endl;
     }
-    os << std::endl;
-  }
-  
-  Position calculateNextInitPos(const Position& p) {
-    Position result = p;
-    result.z++;
-    if (result.z == this->z) {
-      result.z = 0;
-      result.y++;
-      if (result.y >= this->y) {
-        result.y = 0;
-        result.x++;
-      }
+    if (!ok) {
+      return 1;
     }
-    return result;
   }
-  
-
-  Position findFirstEmptyCell(const Position& initPos) {
-    int x = initPos.x;
-    int y = initPos.y;
-    int z = initPos.z;
-    goto inner;
-    for (x = 0; x < this->x; ++x) {
-      for (y = 0; y < this->y; ++y) {
-        for (z = 0; z < this->z; ++z) {
-          inner:
-          if (!isOccupied(x, y, z)) {
-            return {x, y, z};
-          }
-        }
+  Puzzle puzzle = builtinPuzzle();
+  for (int index = 1; !batch && (!reader || reader->next(puzzle)); ++index) {
+    if (binary.is_open()) {
+      if (!writePuzzle(binary, puzzle)) {
+        std::cerr << "Puzzle " << index << " does not fit the binary format"
+                  << std::endl;
+        return 1;
       }
+      continue;
     }
-    return {-1, -1, -1};
-  }
-
-  std::vector<PiecePos> pieces;
-
-  // Output to ostream
-  friend std::ostream &operator<<(std::ostream &os, const Box &box) {
-    os << "Box: [" << box.x << ", " << box.y << ", " << box.z
-       << "], pieces: " << box.pieces.size() << std::endl;
-    for (const auto &p : box.pieces) {
-      std::cout << "  Pos (" << p.pos.x << ", " << p.pos.y << ", " << p.pos.z
-                << ") " << *p.piece << std::endl;
+    cache.attach(puzzle);
+    if (!solveJob(puzzle, index, bool(reader), options, std::cout)) {
+      return 1;
     }
-    box.printVisualize(os);
-    return os;
-  }
-};
-
-void searchNextCellPiece(int level,
-                         const std::vector<PieceOrientsPtr> &pieceOrientPtrs,
-                         Box &box, const Position& initPos, std::vector<Box> &solutions) {
-  auto printIndent = [level]() {
-    for (int i = 0; i < level; ++i) {
-      std::cout << "  ";
+    if (!reader) {
+      break;
     }
-  };
-
-  // Found a solution
-  if (pieceOrientPtrs.empty()) {
-    solutions.push_back(box);
-    return;
   }
-
-  // Find next empty cell in the box
-  Position emptyCell = box.findFirstEmptyCell(initPos);
-  Position nextInitPos = box.calculateNextInitPos(initPos);
-  // printIndent();
-  // std::cout << "Empty cell pos: " << emptyCell << std::endl;
-
-  // For each piece, try all orientations, and push to the empty cell
-  // For each piece
-  for (int i = 0; i < pieceOrientPtrs.size(); ++i) {
-    // For each orientation
-    for (const auto &p : *pieceOrientPtrs[i]) {
-      // Calculate offset: the first point of the piece
-      // should be at the empty cell
-      Position posToTry = {emptyCell.x - p.points_[0].x,
-                           emptyCell.y - p.points_[0].y,
-                           emptyCell.z - p.points_[0].z};
-      // Try to push the piece into the box
-      // printIndent();
-      // std::cout << "  Trying pos" << posToTry << ", " << p << std::endl;
-      bool success = box.tryPushPieceTo(p, posToTry);
-      if (success) {
-        // Remove the piece from the piece set
-        std::vector<PieceOrientsPtr> newPieceOrients = pieceOrientPtrs;
-        newPieceOrients.erase(newPieceOrients.begin() + i);
-        // search for the next piece
-        searchNextCellPiece(level + 1, newPieceOrients, box, nextInitPos, solutions);
-        // Pop the piece
-        box.popPiece();
-      }
-    }
+  if (reader && !reader->error().empty()) {
+    std::cerr << puzzleFile << ": " << reader->error() << std::endl;
+    return 1;
   }
-}
-
-Point operator""_p(const char *str, std::size_t len) {
-  assert(len == 3);
-  return {str[0] - '0', str[1] - '0', str[2] - '0'};
-}
-
-int main() {
-  std::vector<Piece> pieces{
-      Piece(C, {"000"_p, "100"_p, "110"_p, "111"_p}),
-      Piece(D, {"000"_p, "100"_p, "200"_p, "001"_p}),
-      Piece(B, {"000"_p, "100"_p, "200"_p, "210"_p, "211"_p}),
-      Piece(F, {"000"_p, "200"_p, "010"_p, "110"_p, "210"_p, "201"_p}),
-      Piece(A, {"000"_p, "100"_p, "010"_p, "001"_p, "101"_p, "011"_p}),
-      Piece(E, {"000"_p, "100"_p, "200"_p, "010"_p, "110"_p, "210"_p, "201"_p}),
-  };
-
-  std::vector<PieceOrients> pieceOrients;
-  for (const auto &p : pieces) {
-    pieceOrients.push_back(allRotations(p));
+  if (binary.is_open() && !binary) {
+    std::cerr << "Cannot write " << binaryFile << std::endl;
+    return 1;
   }
-
-  std::vector<PieceOrientsPtr> pieceOrientPtrs;
-  std::transform(pieceOrients.begin(), pieceOrients.end(),
-                 std::back_inserter(pieceOrientPtrs),
-                 [](PieceOrients &s) { return &s; });
-
-  // Dump all pieces
-  // for (const auto &s : pieceOrients) {
-  //   std::cout << "Piece set: " << s.size() << std::endl;
-  //   for (const auto &p : s) {
-  //     std::cout << "  " << p << std::endl;
-  //   }
-  // }
-
-  // Search for solutions
-  Box box(4, 4, 2);
-  std::vector<Box> solutions;
-  searchNextCellPiece(0, pieceOrientPtrs, box, {0, 0, 0}, solutions);
-  std::cout << "Found " << solutions.size() << " solutions" << std::endl;
-  std::cout << solutions[0];
 }
@@ -0,0 +1,358 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "search.h"
+
+// The fraction of a search tree already searched, added to by the threads
+// searching it and read by any other thread. Kept in fixed point, as atomic
+// doubles have no fetch_add before C++20.
+class Progress {
+public:
+  void add(double share) { done_ += uint64_t(share * kUnit); }
+  double fraction() const { return done_ / kUnit; }
+
+private:
+  static constexpr double kUnit = double(uint64_t{1} << 52);
+  std::atomic<uint64_t> done_{0};
+};
+
+// Thread pool where every worker owns a task queue. A worker runs its own
+// tasks newest first and, when it runs dry, steals the oldest task of another
+// worker. Tasks submitted from a worker go to that worker's queue, so a task
+// that splits itself keeps its subtasks local until someone steals them.
+class WorkStealingPool {
+public:
+  using Task = std::function<void(int worker)>;
+
+  explicit WorkStealingPool(int numThreads) {
+    for (int i = 0; i < numThreads; ++i) {
+      queues_.push_back(std::make_unique<Queue>());
+    }
+    for (int i = 0; i < numThreads; ++i) {
+      threads_.emplace_back([this, i] { workerLoop(i); });
+    }
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wakeCv_.notify_all();
+    for (auto &t : threads_) {
+      t.join();
+    }
+  }
+
+  int size() const { return threads_.size(); }
+
+  void submit(Task task) {
+    int worker = currentPool_ == this ? currentWorker_
+                                      : nextQueue_++ % queues_.size();
+    {
+      std::lock_guard<std::mutex> lock(queues_[worker]->mutex);
+      queues_[worker]->tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++pending_;
+      ++queued_;
+    }
+    wakeCv_.notify_one();
+  }
+
+  // Block until every submitted task, including the tasks they submitted,
+  // has finished
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    doneCv_.wait(lock, [this] { return pending_ == 0; });
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  bool tryPop(int worker, Task &task) {
+    // Own queue first, newest task
+    {
+      std::lock_guard<std::mutex> lock(queues_[worker]->mutex);
+      if (!queues_[worker]->tasks.empty()) {
+        task = std::move(queues_[worker]->tasks.back());
+        queues_[worker]->tasks.pop_back();
+        return true;
+      }
+    }
+    // Then steal the oldest task of another worker
+    for (int i = 1; i < queues_.size(); ++i) {
+      Queue &victim = *queues_[(worker + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void workerLoop(int worker) {
+    currentPool_ = this;
+    currentWorker_ = worker;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wakeCv_.wait(lock, [this] { return stop_ || queued_ > 0; });
+        if (stop_) {
+          return;
+        }
+      }
+      Task task;
+      if (!tryPop(worker, task)) {
+        continue;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --queued_;
+      }
+      task(worker);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--pending_ == 0) {
+          doneCv_.notify_all();
+        }
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable wakeCv_;
+  std::condition_variable doneCv_;
+  int pending_ = 0; // Submitted but not finished
+  int queued_ = 0;  // Submitted but not started
+  bool stop_ = false;
+  std::atomic<unsigned> nextQueue_{0};
+  static inline thread_local WorkStealingPool *currentPool_ = nullptr;
+  static inline thread_local int currentWorker_ = 0;
+};
+
+// Runs searchNextCellPiece on a thread pool. Every node above splitDepth is a
+// task that pushes one task per child, nodes at splitDepth are searched to
+// completion by the worker that picks them up. Each worker has its own Box
+// and SearchContext.
+template <int N> class ParallelSolver {
+public:
+  ParallelSolver(const Box<N> &box, const SearchContext<N> &ctx,
+                 int numThreads, int splitDepth)
+      : table_(*ctx.table), splitDepth_(splitDepth), pool_(numThreads),
+        boxes_(numThreads, box), contexts_(numThreads, ctx) {}
+
+  // Add the share of the tree of every finished task to progress. A node
+  // shares its part of the tree evenly among its children, so a task at depth
+  // 1 is worth one over the number of top-level branches.
+  void setProgress(Progress *progress) { progress_ = progress; }
+
+  // The counters of all workers added up
+  SearchStats stats() const {
+    SearchStats total;
+    for (const auto &ctx : contexts_) {
+      total.merge(ctx.stats);
+    }
+    return total;
+  }
+
+  // Collect the solutions in one SolutionSink per worker, without any
+  // locking, and merge them into sink once the pool is idle
+  bool solve(SolutionSink<N> &sink) {
+    std::vector<SolutionSink<N>> sinks(
+        boxes_.size(), SolutionSink<N>(sink.maxKept, sink.symmetry));
+    search([&sinks](int worker, const Box<N> &box) {
+      return sinks[worker](box);
+    });
+    for (auto &s : sinks) {
+      sink.merge(s);
+    }
+    return true;
+  }
+
+  // Stream the solutions to visit, one call at a time. Once visit returns
+  // false the workers stop at their next solution or task.
+  template <typename Visitor> bool solve(Visitor &visit) {
+    std::mutex mutex;
+    search([&](int, const Box<N> &box) {
+      std::lock_guard<std::mutex> lock(mutex);
+      return !stopped_ && visit(box);
+    });
+    return !stopped_;
+  }
+
+  // Count the solutions with countSolutions, one running total per worker
+  uint64_t count() {
+    std::vector<uint64_t> counts(boxes_.size(), 0);
+    runTasks([&](int worker, int level, PieceMask remaining, uint64_t weight) {
+      counts[worker] += weight * countSolutions(contexts_[worker], remaining,
+                                                boxes_[worker]);
+    });
+    uint64_t total = 0;
+    for (uint64_t c : counts) {
+      total += c;
+    }
+    return total;
+  }
+
+private:
+  // Run the whole search, calling visit(worker, box) for each solution
+  template <typename WorkerVisitor> void search(WorkerVisitor visit) {
+    runTasks([&](int worker, int level, PieceMask remaining, uint64_t weight) {
+      auto onSolution = [&](const Box<N> &box) {
+        if (!visit(worker, box)) {
+          stopped_ = true;
+        }
+        return !stopped_;
+      };
+      searchBox(level, contexts_[worker], remaining, boxes_[worker],
+                onSolution);
+    });
+  }
+
+  // Split the tree into tasks and call leaf(worker, level, remaining, weight)
+  // for every node at splitDepth, with the worker's box
+  // holding the node and weight the product of its placement weights
+  template <typename Leaf> void runTasks(Leaf leaf) {
+    stopped_ = false;
+    pool_.submit([this, &leaf](int worker) { run({}, 1.0, worker, leaf); });
+    pool_.wait();
+  }
+
+  // Search the subtree below the node reached by placing prefix in order,
+  // which is share of the whole tree
+  template <typename Leaf>
+  void run(const std::vector<const Placement<N> *> &prefix, double share,
+           int worker, Leaf &leaf) {
+    if (stopped_) {
+      return;
+    }
+    Box<N> &box = boxes_[worker];
+    SearchContext<N> &ctx = contexts_[worker];
+    while (!box.pieces.empty()) {
+      box.popPiece();
+    }
+    if (ctx.candidates) {
+      ctx.candidates->reset();
+    }
+    PieceMask remaining = table_.allPieces();
+    uint64_t weight = 1;
+    for (const Placement<N> *p : prefix) {
+      box.pushPiece(*p);
+      if (ctx.candidates) {
+        ctx.candidates->push(p - table_.placements.data());
+      }
+      remaining &= ~(PieceMask{1} << p->piece);
+      weight *= p->weight;
+    }
+
+    if (prefix.size() < splitDepth_ && remaining) {
+      [[maybe_unused]] int level = prefix.size();
+      PACK_COUNT(ctx.stats, level, nodes);
+      int cell = box.firstEmptyCell();
+      std::vector<const Placement<N> *> children;
+      for (PieceMask bits = table_.placeable(remaining); bits;
+           bits &= bits - 1) {
+        int piece = lowestBit(bits);
+        const Placement<N> *end = table_.end(cell, piece);
+        for (const Placement<N> *p = table_.begin(cell, piece); p != end; ++p) {
+          PACK_COUNT(ctx.stats, level, attempts);
+          if (!box.canPush(p->mask)) {
+            continue;
+          }
+          ++ctx.stats.nodes;
+          PACK_COUNT(ctx.stats, level, placements);
+          PieceMask childRemaining = remaining & ~(PieceMask{1} << piece);
+          if (ctx.pruner &&
+              ctx.pruner->isDead(box.occupied | p->mask, childRemaining)) {
+            ++ctx.stats.regionPrunes;
+            PACK_COUNT(ctx.stats, level, regionPrunes);
+            continue;
+          }
+          children.push_back(p);
+        }
+      }
+      for (const Placement<N> *p : children) {
+        std::vector<const Placement<N> *> child = prefix;
+        child.push_back(p);
+        double childShare = share / children.size();
+        pool_.submit([this, child, childShare, &leaf](int worker) {
+          run(child, childShare, worker, leaf);
+        });
+      }
+      if (children.empty()) {
+        addProgress(share);
+      }
+      return;
+    }
+    leaf(worker, prefix.size(), remaining, weight);
+    addProgress(share);
+  }
+
+  void addProgress(double share) {
+    if (progress_) {
+      progress_->add(share);
+    }
+  }
+
+  const PlacementTable<N> &table_;
+  int splitDepth_;
+  WorkStealingPool pool_;
+  std::vector<Box<N>> boxes_;
+  std::vector<SearchContext<N>> contexts_;
+  std::atomic<bool> stopped_{false};
+  Progress *progress_ = nullptr;
+};
+
+// Search box with engine, "backtrack", "iterative" or "dlx", reporting every
+// solution to visit. The backtrack engine runs on a ParallelSolver when
+// numThreads is above 1, or when progress is given, which only the backtrack
+// engine reports. Returns whether the search ran to completion, and sets stats
+// to its counters.
+template <int N, typename Visitor>
+bool searchWithEngine(const std::string &engine, Box<N> &box,
+                      SearchContext<N> &ctx, int numThreads, int splitDepth,
+                      Visitor &visit, SearchStats &stats,
+                      Progress *progress = nullptr) {
+  if (engine == "dlx") {
+    DancingLinks<N> dlx(box, *ctx.table);
+    bool finished = dlx.search(visit);
+    stats = dlx.stats();
+    return finished;
+  }
+  if (engine == "iterative") {
+    IterativeSearch<N> search(box, ctx);
+    bool finished = search.run(visit) == IterativeSearch<N>::Status::Done;
+    stats = search.stats();
+    return finished;
+  }
+  if (numThreads > 1 || progress) {
+    ParallelSolver<N> solver(box, ctx, numThreads, splitDepth);
+    solver.setProgress(progress);
+    bool finished = solver.solve(visit);
+    stats = solver.stats();
+    return finished;
+  }
+  bool finished =
+      searchBox(0, ctx, ctx.table->allPieces(), box, visit);
+  stats = ctx.stats;
+  return finished;
+}
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <initializer_list>
+#include <ostream>
+#include <vector>
+
+// A piece is drawn with a single character, NONE marks an empty cell
+using PieceID = char;
+constexpr PieceID NONE = '.';
+
+// A point is a (x, y, z) coordinate
+struct Point {
+  int x;
+  int y;
+  int z;
+  constexpr bool operator<(const Point &rhs) const {
+    return x < rhs.x || (x == rhs.x && y < rhs.y) ||
+           (x == rhs.x && y == rhs.y && z < rhs.z);
+  }
+  constexpr bool operator==(const Point &rhs) const {
+    return x == rhs.x && y == rhs.y && z == rhs.z;
+  }
+};
+struct Size {
+  int x;
+  int y;
+  int z;
+};
+
+// A rotation of the integer lattice, as a matrix with a single 1 or -1 in
+// every row and column
+struct Rotation {
+  int m[3][3];
+  constexpr Point apply(const Point &p) const {
+    return {m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z,
+            m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z,
+            m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z};
+  }
+};
+
+// The 24 rotation matrices with determinant 1, the identity first
+constexpr std::array<Rotation, 24> allRotationMatrices() {
+  // Axis permutations and their parity
+  const int perms[6][3] = {{0, 1, 2}, {0, 2, 1}, {1, 0, 2},
+                           {1, 2, 0}, {2, 0, 1}, {2, 1, 0}};
+  const int parity[6] = {1, -1, -1, 1, 1, -1};
+  std::array<Rotation, 24> result{};
+  int count = 0;
+  for (int p = 0; p < 6; ++p) {
+    for (int s = 0; s < 8; ++s) {
+      int sign[3] = {s & 1 ? -1 : 1, s & 2 ? -1 : 1, s & 4 ? -1 : 1};
+      if (parity[p] * sign[0] * sign[1] * sign[2] != 1) {
+        continue;
+      }
+      Rotation &r = result[count++];
+      for (int i = 0; i < 3; ++i) {
+        r.m[i][perms[p][i]] = sign[i];
+      }
+    }
+  }
+  return result;
+}
+
+constexpr std::array<Rotation, 24> kRotations = allRotationMatrices();
+
+// Largest number of cells in a piece
+constexpr int kMaxShapeCells = 16;
+
+// The cells of a piece in a fixed-size array, so that shapes can be rotated
+// and compared in constant expressions
+struct Shape {
+  std::array<Point, kMaxShapeCells> points{};
+  int numPoints = 0;
+  Size size{};
+
+  constexpr Shape() = default;
+  constexpr Shape(std::initializer_list<Point> list) {
+    for (const Point &p : list) {
+      add(p);
+    }
+    normalize();
+  }
+
+  constexpr void add(const Point &p) {
+    assert(numPoints < kMaxShapeCells);
+    points[numPoints++] = p;
+  }
+
+  // Same as Piece::normalize, with an insertion sort, std::sort is not
+  // constexpr
+  constexpr Shape &normalize() {
+    Point min = points[0];
+    for (int i = 1; i < numPoints; ++i) {
+      min.x = std::min(min.x, points[i].x);
+      min.y = std::min(min.y, points[i].y);
+      min.z = std::min(min.z, points[i].z);
+    }
+    size = {0, 0, 0};
+    for (int i = 0; i < numPoints; ++i) {
+      Point &p = points[i];
+      p = {p.x - min.x, p.y - min.y, p.z - min.z};
+      size = {std::max(size.x, p.x + 1), std::max(size.y, p.y + 1),
+              std::max(size.z, p.z + 1)};
+    }
+    for (int i = 1; i < numPoints; ++i) {
+      Point p = points[i];
+      int j = i;
+      for (; j > 0 && p < points[j - 1]; --j) {
+        points[j] = points[j - 1];
+      }
+      points[j] = p;
+    }
+    return *this;
+  }
+
+  constexpr Shape rotated(const Rotation &r) const {
+    Shape result;
+    for (int i = 0; i < numPoints; ++i) {
+      result.add(r.apply(points[i]));
+    }
+    return result.normalize();
+  }
+
+  // Reflect the shape in the yz-plane
+  constexpr Shape mirrored() const {
+    Shape result;
+    for (int i = 0; i < numPoints; ++i) {
+      result.add({-points[i].x, points[i].y, points[i].z});
+    }
+    return result.normalize();
+  }
+
+  constexpr bool operator==(const Shape &rhs) const {
+    if (numPoints != rhs.numPoints) {
+      return false;
+    }
+    for (int i = 0; i < numPoints; ++i) {
+      if (!(points[i] == rhs.points[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// The distinct orientations of a shape, in the order of kRotations
+struct Orientations {
+  std::array<Shape, 24> shapes{};
+  int count = 0;
+};
+
+constexpr Orientations orientationsOf(const Shape &shape) {
+  Orientations result;
+  for (const Rotation &r : kRotations) {
+    Shape s = shape.rotated(r);
+    bool seen = false;
+    for (int i = 0; i < result.count && !seen; ++i) {
+      seen = result.shapes[i] == s;
+    }
+    if (!seen) {
+      result.shapes[result.count++] = s;
+    }
+  }
+  return result;
+}
+
+// A piece is a set of points, stored inline: the cells as packed
+// coordinates, and a voxel mask of the bounding box with bit
+// (x * size.y + y) * size.z + z set for every cell. Cells are sorted, so
+// they are in the order of the mask bits and the first one is the anchor.
+// The bounding box must have at most 64 cells.
+class Piece {
+public:
+  // A cell relative to the corner of the bounding box
+  struct Cell {
+    uint8_t x;
+    uint8_t y;
+    uint8_t z;
+  };
+
+  Piece(PieceID id, std::initializer_list<Point> points)
+      : Piece(id, Shape(points)) {}
+  Piece(PieceID id, const Shape &shape) : id_{id}, size_(shape.size) {
+    assert(size_.x * size_.y * size_.z <= 64);
+    numCells_ = shape.numPoints;
+    for (int i = 0; i < numCells_; ++i) {
+      const Point &p = shape.points[i];
+      cells_[i] = {uint8_t(p.x), uint8_t(p.y), uint8_t(p.z)};
+      voxels_ |= uint64_t{1} << ((p.x * size_.y + p.y) * size_.z + p.z);
+    }
+    // splitmix64 finalizer over the mask and the size
+    uint64_t h = voxels_ ^ (uint64_t(size_.x) << 58 | uint64_t(size_.y) << 52 |
+                            uint64_t(size_.z) << 46) * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    hash_ = h ^ (h >> 31);
+  }
+
+  Shape shape() const {
+    Shape result;
+    for (const Cell &c : *this) {
+      result.add({c.x, c.y, c.z});
+    }
+    return result.normalize();
+  }
+
+  // Rotate the piece, and move it back to the origin
+  Piece &rotate(const Rotation &r) {
+    return *this = Piece(id_, shape().rotated(r));
+  }
+
+  // Rotate the piece 90 degrees clockwise around the z-axis
+  Piece &rotateZ() { return rotate({{{0, 1, 0}, {-1, 0, 0}, {0, 0, 1}}}); }
+
+  // Rotate the piece 90 degrees clockwise around the x-axis
+  Piece &rotateX() { return rotate({{{1, 0, 0}, {0, 0, 1}, {0, -1, 0}}}); }
+
+  // Rotate the piece 90 degrees clockwise around the y-axis
+  Piece &rotateY() { return rotate({{{0, 0, 1}, {0, 1, 0}, {-1, 0, 0}}}); }
+
+  int numCells() const { return numCells_; }
+  const Cell *begin() const { return cells_.data(); }
+  const Cell *end() const { return cells_.data() + numCells_; }
+  uint64_t voxels() const { return voxels_; }
+  uint64_t hash() const { return hash_; }
+
+  // Two pieces are equal if they have the same bounding box and voxels
+  bool operator==(const Piece &rhs) const {
+    return voxels_ == rhs.voxels_ && sizeKey() == rhs.sizeKey();
+  }
+
+  // Print to ostream
+  friend std::ostream &operator<<(std::ostream &os, const Piece &piece) {
+    os << "ID: " << piece.id_ << ", size: [" << piece.size_.x
+       << ", " << piece.size_.y << ", " << piece.size_.z << "], points: [ ";
+    for (const auto &p : piece) {
+      os << "(" << int(p.x) << ", " << int(p.y) << ", " << int(p.z) << ") ";
+    }
+    os << "]";
+    return os;
+  }
+
+  // Order pieces by bounding box, then by voxels
+  bool operator<(const Piece &rhs) const {
+    return sizeKey() < rhs.sizeKey() ||
+           (sizeKey() == rhs.sizeKey() && voxels_ < rhs.voxels_);
+  }
+
+  PieceID id_;
+  Size size_; // The size of the bounding box
+
+private:
+  uint32_t sizeKey() const { return size_.x << 16 | size_.y << 8 | size_.z; }
+
+  std::array<Cell, kMaxShapeCells> cells_;
+  uint8_t numCells_;
+  uint64_t voxels_ = 0;
+  uint64_t hash_;
+};
+
+// PieceSet is all possible orientations of a piece, without duplicates
+using PieceOrients = std::vector<Piece>;
+
+// Add the orientations of a piece that fit in a box of the given size and
+// are not in result yet
+inline void addOrientations(PieceID id, const Orientations &orients,
+                            const Size &bounds, PieceOrients &result) {
+  for (int i = 0; i < orients.count; ++i) {
+    const Size &size = orients.shapes[i].size;
+    if (size.x > bounds.x || size.y > bounds.y || size.z > bounds.z) {
+      continue;
+    }
+    Piece p(id, orients.shapes[i]);
+    if (std::find(result.begin(), result.end(), p) == result.end()) {
+      result.push_back(p);
+    }
+  }
+}
+
+// The orientations of a piece that fit in a box of the given size
+inline PieceOrients toPieceOrients(PieceID id, const Orientations &orients,
+                                   const Size &bounds) {
+  PieceOrients result;
+  addOrientations(id, orients, bounds, result);
+  return result;
+}
+
+// Generate all 24 rotations of a piece, keeping those that fit in bounds
+inline PieceOrients allRotations(const Piece &p, const Size &bounds) {
+  return toPieceOrients(p.id_, orientationsOf(p.shape()), bounds);
+}
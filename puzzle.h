@@ -0,0 +1,423 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdio>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "box.h"
+#include "piece.h"
+
+constexpr Point operator""_p(const char *str, std::size_t len) {
+  assert(len == 3);
+  return {str[0] - '0', str[1] - '0', str[2] - '0'};
+}
+
+// The pieces of the built-in puzzle, their orientations are computed at
+// compile time
+constexpr int kNumBuiltinPieces = 6;
+constexpr PieceID kBuiltinIDs[kNumBuiltinPieces] = {'C', 'D', 'B',
+                                                    'F', 'A', 'E'};
+constexpr Shape kBuiltinShapes[kNumBuiltinPieces] = {
+    {"000"_p, "100"_p, "110"_p, "111"_p},
+    {"000"_p, "100"_p, "200"_p, "001"_p},
+    {"000"_p, "100"_p, "200"_p, "210"_p, "211"_p},
+    {"000"_p, "200"_p, "010"_p, "110"_p, "210"_p, "201"_p},
+    {"000"_p, "100"_p, "010"_p, "001"_p, "101"_p, "011"_p},
+    {"000"_p, "100"_p, "200"_p, "010"_p, "110"_p, "210"_p, "201"_p},
+};
+constexpr std::array<Orientations, kNumBuiltinPieces> kBuiltinOrientations = {
+    orientationsOf(kBuiltinShapes[0]), orientationsOf(kBuiltinShapes[1]),
+    orientationsOf(kBuiltinShapes[2]), orientationsOf(kBuiltinShapes[3]),
+    orientationsOf(kBuiltinShapes[4]), orientationsOf(kBuiltinShapes[5]),
+};
+
+// A piece of a puzzle, packed count times
+struct PuzzlePiece {
+  PieceID id;
+  int count = 1;
+  Shape shape;
+  // Orientations of shape and of its mirror image computed ahead of time,
+  // or nullptr
+  const Orientations *orientations = nullptr;
+  const Orientations *reflected = nullptr;
+};
+
+// A set of pieces and the box to pack them into. The cells of the box
+// outside the target shape are blocked.
+struct Puzzle {
+  std::string name;
+  Size size{0, 0, 0};
+  CellSet blocked;
+  bool reflections = false; // Whether pieces may also be mirrored
+  std::vector<PuzzlePiece> pieces;
+
+  // Number of cells of all pieces
+  int volume() const {
+    int result = 0;
+    for (const auto &piece : pieces) {
+      result += piece.count * piece.shape.numPoints;
+    }
+    return result;
+  }
+};
+
+inline Puzzle builtinPuzzle() {
+  Puzzle puzzle;
+  puzzle.size = {4, 4, 2};
+  for (int i = 0; i < kNumBuiltinPieces; ++i) {
+    puzzle.pieces.push_back(
+        {kBuiltinIDs[i], 1, kBuiltinShapes[i], &kBuiltinOrientations[i]});
+  }
+  return puzzle;
+}
+
+// The orientations of every piece of puzzle that fit in a box of the given
+// size, one entry per copy
+inline std::vector<PieceOrients> puzzleOrients(const Puzzle &puzzle,
+                                               const Size &size) {
+  std::vector<PieceOrients> result;
+  for (const auto &piece : puzzle.pieces) {
+    PieceOrients orients;
+    addOrientations(piece.id,
+                    piece.orientations ? *piece.orientations
+                                       : orientationsOf(piece.shape),
+                    size, orients);
+    if (puzzle.reflections) {
+      addOrientations(piece.id,
+                      piece.reflected ? *piece.reflected
+                                      : orientationsOf(piece.shape.mirrored()),
+                      size, orients);
+    }
+    result.insert(result.end(), piece.count, orients);
+  }
+  return result;
+}
+
+// The orientations of every shape seen so far, shared by all the pieces with
+// that shape. Not thread-safe, it is filled in by the thread reading the
+// puzzles, the tables it hands out can be read from any thread.
+class OrientationCache {
+public:
+  // Point the pieces of puzzle at the orientations of their shapes
+  void attach(Puzzle &puzzle) {
+    for (auto &piece : puzzle.pieces) {
+      if (!piece.orientations) {
+        piece.orientations = find(piece.shape);
+      }
+      if (puzzle.reflections && !piece.reflected) {
+        piece.reflected = find(piece.shape.mirrored());
+      }
+    }
+  }
+
+private:
+  struct Entry {
+    Shape shape;
+    Orientations orientations;
+  };
+
+  const Orientations *find(const Shape &shape) {
+    auto &entries = entries_[Piece(NONE, shape).hash()];
+    for (const auto &e : entries) {
+      if (e->shape == shape) {
+        return &e->orientations;
+      }
+    }
+    entries.push_back(
+        std::make_unique<Entry>(Entry{shape, orientationsOf(shape)}));
+    return &entries.back()->orientations;
+  }
+
+  std::unordered_map<uint64_t, std::vector<std::unique_ptr<Entry>>> entries_;
+};
+
+// First bytes of the binary puzzle format
+const char kPuzzleMagic[4] = {'P', 'K', 'P', 'Z'};
+
+// Bytes of the blocked cells of a box of size in the binary format. Never
+// below the 8 of a single word, the size of the field in boxes up to 64 cells.
+inline int blockedBytes(const Size &size) {
+  return std::max(8, (size.x * size.y * size.z + 7) / 8);
+}
+
+// Reads puzzles one at a time from a stream in the text format below, or in
+// its binary form written by writePuzzle().
+//
+//   # Everything after a '#' is a comment
+//   puzzle <name>             Starts the next puzzle, may be left out for
+//                             a single puzzle
+//   box <X> <Y> <Z>           The box to fill, or
+//   target <X> <Y> <Z>        only some of its cells. X lines follow, each
+//                             with Z words of Y characters, '#' for a cell to
+//                             fill and '.' for a blocked one: the layout
+//                             solutions are printed in.
+//   reflections yes|no        Whether pieces may be mirrored, no by default
+//   piece <c> [x<N>] <x,y,z>...
+//                             A piece drawn as character c with the given
+//                             cells, N copies of it
+//
+// The binary form is kPuzzleMagic followed by one record per puzzle:
+//
+//   u8 name length, name, u8 X, Y, Z, the blocked cells as a little endian
+//   bitset of X * Y * Z bits in at least 8 bytes,
+//   u8 reflections, u8 number of pieces, then for each piece
+//   u8 c, u8 N, u8 number of cells, u8 x, y, z for each cell
+class PuzzleReader {
+public:
+  explicit PuzzleReader(std::istream &in) : in_(in) {
+    int matched = 0;
+    while (matched < 4 && in_.peek() == kPuzzleMagic[matched]) {
+      in_.get();
+      ++matched;
+    }
+    binary_ = matched == 4;
+    // Not the binary form, put back what was read
+    for (int i = matched - 1; !binary_ && i >= 0; --i) {
+      in_.putback(kPuzzleMagic[i]);
+    }
+  }
+
+  // Read the next puzzle. Returns false at the end of the input, or on an
+  // error, see error().
+  bool next(Puzzle &puzzle) {
+    puzzle = Puzzle();
+    bool found = binary_ ? nextBinary(puzzle) : nextText(puzzle);
+    return found && check(puzzle);
+  }
+
+  // Why next() failed, empty at the end of the input
+  const std::string &error() const { return error_; }
+
+private:
+  bool nextText(Puzzle &puzzle) {
+    bool started = false;
+    std::string line;
+    while (readLine(line)) {
+      std::istringstream words(line.substr(0, line.find('#')));
+      std::string key;
+      if (!(words >> key)) {
+        continue;
+      }
+      if (key == "puzzle") {
+        if (started) {
+          // The start of the next puzzle
+          pending_ = line;
+          hasPending_ = true;
+          break;
+        }
+        words >> puzzle.name;
+      } else if (key == "box" || key == "target") {
+        Size &size = puzzle.size;
+        if (!(words >> size.x >> size.y >> size.z) || size.x <= 0 ||
+            size.y <= 0 || size.z <= 0) {
+          return fail("expected a box size");
+        }
+        if (size.x * size.y * size.z > kMaxCells) {
+          return fail("boxes over " + std::to_string(kMaxCells) +
+                      " cells are not supported");
+        }
+        if (key == "target" && !readTarget(puzzle)) {
+          return false;
+        }
+      } else if (key == "reflections") {
+        std::string value;
+        words >> value;
+        if (value != "yes" && value != "no") {
+          return fail("expected reflections yes or no");
+        }
+        puzzle.reflections = value == "yes";
+      } else if (key == "piece") {
+        if (!readPiece(words, puzzle)) {
+          return false;
+        }
+      } else {
+        return fail("unknown keyword " + key);
+      }
+      started = true;
+    }
+    return started;
+  }
+
+  bool readLine(std::string &line) {
+    if (hasPending_) {
+      line = pending_;
+      hasPending_ = false;
+      return true;
+    }
+    if (!std::getline(in_, line)) {
+      return false;
+    }
+    ++line_;
+    return true;
+  }
+
+  bool readTarget(Puzzle &puzzle) {
+    const Size &size = puzzle.size;
+    for (int x = 0; x < size.x; ++x) {
+      std::string line;
+      if (!readLine(line)) {
+        return fail("the target ends early");
+      }
+      std::istringstream words(line);
+      for (int z = 0; z < size.z; ++z) {
+        std::string word;
+        if (!(words >> word) || word.size() != size.y) {
+          return fail("expected " + std::to_string(size.z) + " words of " +
+                      std::to_string(size.y) + " cells");
+        }
+        for (int y = 0; y < size.y; ++y) {
+          if (word[y] != '#' && word[y] != '.') {
+            return fail("a target cell is either '#' or '.'");
+          }
+          if (word[y] == '.') {
+            puzzle.blocked.set((x * size.y + y) * size.z + z);
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+  bool readPiece(std::istringstream &words, Puzzle &puzzle) {
+    PuzzlePiece piece;
+    std::string word;
+    if (!(words >> word) || word.size() != 1 || word[0] == NONE ||
+        word[0] == '#') {
+      return fail("a piece needs a single character name");
+    }
+    piece.id = word[0];
+    while (words >> word) {
+      Point p;
+      char rest;
+      if (word[0] == 'x' && std::sscanf(word.c_str() + 1, "%d%c", &piece.count,
+                                        &rest) == 1) {
+        if (piece.count <= 0) {
+          return fail("bad number of copies " + word);
+        }
+      } else if (std::sscanf(word.c_str(), "%d,%d,%d%c", &p.x, &p.y, &p.z,
+                             &rest) == 3) {
+        if (piece.shape.numPoints == kMaxShapeCells) {
+          return fail("pieces have at most " + std::to_string(kMaxShapeCells) +
+                      " cells");
+        }
+        piece.shape.add(p);
+      } else if (word[0] == '#') {
+        break;
+      } else {
+        return fail("bad cell " + word);
+      }
+    }
+    puzzle.pieces.push_back(piece);
+    return true;
+  }
+
+  bool nextBinary(Puzzle &puzzle) {
+    int length = in_.get();
+    if (length == EOF) {
+      return false;
+    }
+    puzzle.name.resize(length);
+    in_.read(&puzzle.name[0], length);
+    puzzle.size = {in_.get(), in_.get(), in_.get()};
+    // A box too large for blocked is read through, for check() to reject
+    for (int i = 0; i < blockedBytes(puzzle.size); ++i) {
+      Bitboard byte = in_.get() & 0xff;
+      if (i < 8 * kMaxWords) {
+        puzzle.blocked.words[i / 8] |= byte << (8 * (i % 8));
+      }
+    }
+    puzzle.reflections = in_.get();
+    int numPieces = in_.get();
+    for (int i = 0; i < numPieces && in_; ++i) {
+      PuzzlePiece piece;
+      piece.id = in_.get();
+      piece.count = in_.get();
+      int numCells = in_.get();
+      for (int j = 0; j < numCells && j < kMaxShapeCells; ++j) {
+        piece.shape.add({in_.get(), in_.get(), in_.get()});
+      }
+      puzzle.pieces.push_back(piece);
+    }
+    if (!in_) {
+      return fail("truncated puzzle");
+    }
+    return true;
+  }
+
+  // Normalize the pieces and check that the puzzle can be searched
+  bool check(Puzzle &puzzle) {
+    const Size &size = puzzle.size;
+    if (size.x <= 0 || size.y <= 0 || size.z <= 0 ||
+        size.x * size.y * size.z > kMaxCells) {
+      return fail("a puzzle needs a box of 1 to " + std::to_string(kMaxCells) +
+                  " cells");
+    }
+    int numPieces = 0;
+    for (auto &piece : puzzle.pieces) {
+      Shape &shape = piece.shape.normalize();
+      for (int i = 1; i < shape.numPoints; ++i) {
+        if (shape.points[i] == shape.points[i - 1]) {
+          return fail(std::string("piece ") + piece.id + " repeats a cell");
+        }
+      }
+      if (shape.numPoints == 0 ||
+          shape.size.x * shape.size.y * shape.size.z > 64) {
+        return fail(std::string("piece ") + piece.id +
+                    " needs 1 to 64 cells in its bounding box");
+      }
+      numPieces += piece.count;
+    }
+    if (numPieces == 0 || numPieces > 64) {
+      return fail("a puzzle has 1 to 64 pieces");
+    }
+    return true;
+  }
+
+  bool fail(const std::string &message) {
+    error_ = binary_ ? message
+                     : "line " + std::to_string(line_) + ": " + message;
+    return false;
+  }
+
+  std::istream &in_;
+  bool binary_ = false;
+  int line_ = 0;
+  std::string pending_; // A line read ahead, the start of the next puzzle
+  bool hasPending_ = false;
+  std::string error_;
+};
+
+// Append puzzle to out in the binary form read by PuzzleReader, after
+// kPuzzleMagic has been written once. Returns false, writing nothing, for a
+// box side over the 255 cells that the format holds.
+inline bool writePuzzle(std::ostream &out, const Puzzle &puzzle) {
+  const Size &size = puzzle.size;
+  if (std::max({size.x, size.y, size.z}) > 255) {
+    return false;
+  }
+  std::string name = puzzle.name.substr(0, 255);
+  out.put(name.size());
+  out.write(name.data(), name.size());
+  out.put(puzzle.size.x).put(puzzle.size.y).put(puzzle.size.z);
+  for (int i = 0; i < blockedBytes(puzzle.size); ++i) {
+    out.put(puzzle.blocked.words[i / 8] >> (8 * (i % 8)) & 0xff);
+  }
+  out.put(puzzle.reflections);
+  out.put(puzzle.pieces.size());
+  for (const auto &piece : puzzle.pieces) {
+    out.put(piece.id).put(piece.count).put(piece.shape.numPoints);
+    for (int i = 0; i < piece.shape.numPoints; ++i) {
+      const Point &p = piece.shape.points[i];
+      out.put(p.x).put(p.y).put(p.z);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,1372 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "box.h"
+
+// The rotations that map the box onto itself, used to search only one
+// solution out of each set of rotated copies. One piece, the anchor piece, is
+// restricted to a single placement out of every orbit of its placements
+// under the group. Any solution can be rotated to put the anchor piece on its
+// orbit's representative, so every solution is still found up to rotation,
+// and a solution found stands for as many raw solutions as the orbit has
+// placements. Rotations that fix the representative map found solutions onto
+// each other, isCanonical() tells the first of those apart.
+template <int N> class BoxSymmetry {
+public:
+  using Board = Occupancy<N>;
+
+  BoxSymmetry(const Box<N> &box, const PlacementTable<N> &table)
+      : numPieces_(table.numPieces), copies_(table.copies) {
+    int dims[3] = {box.x, box.y, box.z};
+    for (const Rotation &r : kRotations) {
+      // The rotated box must have the same dimensions
+      bool fits = true;
+      for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+          fits = fits && (r.m[i][j] == 0 || dims[i] == dims[j]);
+        }
+      }
+      if (!fits) {
+        continue;
+      }
+      std::vector<int> cellMap(box.x * box.y * box.z);
+      for (int x = 0; x < box.x; ++x) {
+        for (int y = 0; y < box.y; ++y) {
+          for (int z = 0; z < box.z; ++z) {
+            // Move the rotated box back onto the box: a reversed axis
+            // runs from 1 - size to 0
+            Point q = r.apply({x, y, z});
+            Point shift = r.apply({box.x - 1, box.y - 1, box.z - 1});
+            q.x -= std::min(shift.x, 0);
+            q.y -= std::min(shift.y, 0);
+            q.z -= std::min(shift.z, 0);
+            cellMap[box.cellIndex(x, y, z)] = box.cellIndex(q.x, q.y, q.z);
+          }
+        }
+      }
+      // The blocked cells must map onto themselves as well
+      Board image;
+      for (Board bits = box.blocked; bits; bits.clearLowestBit()) {
+        image.set(cellMap[lowestBit(bits)]);
+      }
+      if (image != box.blocked) {
+        continue;
+      }
+      rotations_.push_back(cellMaps_.size());
+      cellMaps_.push_back(cellMap);
+    }
+    if (order() == 1) {
+      return;
+    }
+
+    // Choose the anchor piece with the fewest representatives that are fixed
+    // by a rotation, then with the fewest representatives
+    int bestFixed = INT_MAX;
+    int bestReps = INT_MAX;
+    for (int i = 0; i < table.numPieces; ++i) {
+      // The copies of a piece can trade places, so none of them can anchor
+      if ((table.copies >> i & 1) ||
+          (i + 1 < table.numPieces && (table.copies >> (i + 1) & 1))) {
+        continue;
+      }
+      std::unordered_map<Board, Orbit> reps;
+      int fixed = 0;
+      for (const auto &p : table.placements) {
+        if (p.piece != i) {
+          continue;
+        }
+        Orbit orbit;
+        bool smallest = true;
+        for (int g = 0; g < order(); ++g) {
+          Board image = mapMask(p.mask, g);
+          smallest = smallest && !(image < p.mask);
+          if (image == p.mask) {
+            orbit.stabilizer.push_back(g);
+          }
+        }
+        if (smallest) {
+          orbit.size = order() / orbit.stabilizer.size();
+          fixed += orbit.stabilizer.size() > 1;
+          reps[p.mask] = orbit;
+        }
+      }
+      if (std::make_pair(fixed, reps.size()) <
+          std::make_pair(bestFixed, (size_t)bestReps)) {
+        bestFixed = fixed;
+        bestReps = reps.size();
+        piece_ = i;
+        reps_ = std::move(reps);
+      }
+    }
+  }
+
+  int order() const { return cellMaps_.size(); }
+  int piece() const { return piece_; }
+
+  // The table without the placements of the anchor piece that are not the
+  // representative of their orbit
+  PlacementTable<N> restrict(const PlacementTable<N> &table) const {
+    PlacementTable<N> result;
+    result.numPieces = table.numPieces;
+    result.volumes = table.volumes;
+    result.copies = table.copies;
+    for (int group = 0; group + 1 < table.start.size(); ++group) {
+      result.start.push_back(result.placements.size());
+      for (int i = table.start[group]; i < table.start[group + 1]; ++i) {
+        const Placement<N> &p = table.placements[i];
+        if (p.piece != piece_) {
+          result.placements.push_back(p);
+        } else if (reps_.count(p.mask)) {
+          result.placements.push_back(p);
+          result.placements.back().weight = reps_.at(p.mask).size;
+        }
+      }
+    }
+    result.start.push_back(result.placements.size());
+    result.finish();
+    return result;
+  }
+
+  // Number of raw solutions that a solution of the restricted search stands
+  // for
+  uint64_t weight(const Box<N> &box) const {
+    for (const auto &p : box.pieces) {
+      if (p.pieceIndex == piece_) {
+        return reps_.at(p.mask).size;
+      }
+    }
+    return 1;
+  }
+
+  // Whether no rotation fixing the anchor piece maps box to a solution that
+  // is smaller, comparing the piece masks in piece order. The masks of copies
+  // are compared sorted, as the copies are interchangeable. Without an anchor
+  // piece every rotation is tried.
+  bool isCanonical(const Box<N> &box) const {
+    Board masks[64];
+    const Orbit *orbit = nullptr;
+    for (const auto &p : box.pieces) {
+      masks[p.pieceIndex] = p.mask;
+      if (p.pieceIndex == piece_) {
+        orbit = &reps_.at(p.mask);
+      }
+    }
+    if (!orbit && piece_ >= 0) {
+      return true;
+    }
+    sortCopies(masks);
+    for (int g : orbit ? orbit->stabilizer : rotations_) {
+      Board images[64];
+      for (int i = 0; i < numPieces_; ++i) {
+        images[i] = mapMask(masks[i], g);
+      }
+      sortCopies(images);
+      if (std::lexicographical_compare(images, images + numPieces_, masks,
+                                       masks + numPieces_)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  struct Orbit {
+    uint64_t size;               // Number of placements in the orbit
+    std::vector<int> stabilizer; // The rotations fixing the representative
+  };
+
+  // Sort the masks of every run of copies
+  void sortCopies(Board *masks) const {
+    for (int i = 0, j; i < numPieces_; i = j) {
+      for (j = i + 1; j < numPieces_ && (copies_ >> j & 1); ++j) {
+      }
+      std::sort(masks + i, masks + j);
+    }
+  }
+
+  Board mapMask(Board mask, int g) const {
+    Board image;
+    for (; mask; mask.clearLowestBit()) {
+      image.set(cellMaps_[g][lowestBit(mask)]);
+    }
+    return image;
+  }
+
+  int numPieces_;
+  PieceMask copies_;
+  std::vector<std::vector<int>> cellMaps_; // Cell permutation per rotation
+  std::vector<int> rotations_;             // 0 to order() - 1
+  int piece_ = -1;
+  // Orbit of each placement of the anchor piece that is kept, by mask
+  std::unordered_map<Board, Orbit> reps_;
+};
+
+// The searches report each solution to a visitor, a callable taking the
+// search's own Box and returning whether to go on:
+//
+//   bool visit(const Box &box);
+//
+// box.pieces holds the placements of the solution. The box is only valid
+// during the call, so a visitor copies whatever it wants to keep. Returning
+// false stops the search, and the search function then returns false too.
+
+// Visitor that collects the solutions. Every solution is counted, but only
+// the first maxKept are copied, so a count-only search (maxKept == 0) never
+// copies a Box or allocates. When searching a table restricted by a
+// BoxSymmetry, count is the number of raw solutions and distinct the number
+// of solutions up to rotation, and only distinct ones are kept.
+template <int N> struct SolutionSink {
+  explicit SolutionSink(size_t maxKept = SIZE_MAX,
+                        const BoxSymmetry<N> *symmetry = nullptr)
+      : maxKept(maxKept), symmetry(symmetry) {}
+
+  bool operator()(const Box<N> &box) {
+    add(box);
+    return true;
+  }
+
+  bool wantsBox() const { return solutions.size() < maxKept; }
+
+  void add(const Box<N> &box) {
+    if (symmetry) {
+      count += symmetry->weight(box);
+      if (!symmetry->isCanonical(box)) {
+        return;
+      }
+    } else {
+      ++count;
+    }
+    ++distinct;
+    if (wantsBox()) {
+      solutions.push_back(box);
+    }
+  }
+
+  // Move the solutions of another sink, e.g. of another thread, into this one
+  void merge(SolutionSink &other) {
+    count += other.count;
+    distinct += other.distinct;
+    for (auto &box : other.solutions) {
+      if (!wantsBox()) {
+        break;
+      }
+      solutions.push_back(std::move(box));
+    }
+    other.count = 0;
+    other.distinct = 0;
+    other.solutions.clear();
+  }
+
+  size_t maxKept;
+  const BoxSymmetry<N> *symmetry;
+  uint64_t count = 0;
+  uint64_t distinct = 0;
+  std::vector<Box<N>> solutions;
+};
+
+// Box dimensions fixed at compile time, in x-y-z scan order. The cells next
+// to a set of cells are then a few shifts of its word, masked so that no step
+// wraps around an edge of the box. RegionPruner floods with them in the
+// boxes it has a FixedBox for.
+template <int X, int Y, int Z> struct FixedBox {
+  static_assert(X * Y * Z <= 64, "A fixed box must fit in one word");
+  static constexpr int kNumCells = X * Y * Z;
+  static constexpr Bitboard kAll =
+      kNumCells == 64 ? ~Bitboard{0} : (Bitboard{1} << kNumCells) - 1;
+
+  static constexpr int cellIndex(int x, int y, int z) {
+    return (x * Y + y) * Z + z;
+  }
+
+  // The cells whose coordinate on axis (0 for x, 1 for y, 2 for z) is not
+  // value
+  static constexpr Bitboard cellsOff(int axis, int value) {
+    Bitboard cells = 0;
+    for (int x = 0; x < X; ++x) {
+      for (int y = 0; y < Y; ++y) {
+        for (int z = 0; z < Z; ++z) {
+          int c[3] = {x, y, z};
+          if (c[axis] != value) {
+            cells |= Bitboard{1} << cellIndex(x, y, z);
+          }
+        }
+      }
+    }
+    return cells;
+  }
+
+  // The cells and their neighbours in the box
+  static Bitboard grow(Bitboard cells) {
+    constexpr Bitboard kNotYFirst = cellsOff(1, 0);
+    constexpr Bitboard kNotYLast = cellsOff(1, Y - 1);
+    constexpr Bitboard kNotZFirst = cellsOff(2, 0);
+    constexpr Bitboard kNotZLast = cellsOff(2, Z - 1);
+    Bitboard grown = cells;
+    if constexpr (X > 1) {
+      grown |= cells << (Y * Z) | cells >> (Y * Z);
+    }
+    if constexpr (Y > 1) {
+      grown |= (cells & kNotYLast) << Z | (cells & kNotYFirst) >> Z;
+    }
+    if constexpr (Z > 1) {
+      grown |= (cells & kNotZLast) << 1 | (cells & kNotZFirst) >> 1;
+    }
+    return grown & kAll;
+  }
+};
+
+// Cuts nodes whose empty cells have split into a region that the remaining
+// pieces cannot fill: each connected region of empty cells must hold exactly
+// the volume of some subset of the remaining pieces.
+template <int N> class RegionPruner {
+public:
+  using Board = Occupancy<N>;
+
+  RegionPruner(const Box<N> &box, const PlacementTable<N> &table)
+      : volumes_(table.volumes) {
+    int numCells = box.x * box.y * box.z;
+    all_ = Board::firstCells(numCells);
+    neighbors_.resize(numCells);
+    for (int cell = 0; cell < numCells; ++cell) {
+      Position p = box.cellPosition(cell);
+      const Position steps[6] = {{-1, 0, 0}, {1, 0, 0},  {0, -1, 0},
+                                 {0, 1, 0},  {0, 0, -1}, {0, 0, 1}};
+      for (const auto &s : steps) {
+        Position n = {p.x + s.x, p.y + s.y, p.z + s.z};
+        if (!box.isOutOfBound(n)) {
+          neighbors_[cell] |= box.cellBit(n.x, n.y, n.z);
+        }
+      }
+    }
+    // Flood with the shifts of a FixedBox in the boxes prebuilt for it
+    if constexpr (N == 1) {
+      if (box.hasScanOrder()) {
+        useFixedBox<4, 4, 2>(box) || useFixedBox<3, 3, 3>(box) ||
+            useFixedBox<5, 4, 3>(box) || useFixedBox<6, 10, 1>(box) ||
+            useFixedBox<10, 6, 1>(box);
+      }
+    }
+  }
+
+  // Whether some region of empty cells cannot be filled by the remaining
+  // pieces
+  bool isDead(const Board &occupied, PieceMask remaining) const {
+    return (this->*isDead_)(occupied, remaining);
+  }
+
+private:
+  using Sums = std::bitset<Board::kNumCells + 1>;
+
+  // Volumes that a subset of the remaining pieces adds up to
+  Sums sums(PieceMask remaining) const {
+    Sums sums;
+    sums[0] = true;
+    for (PieceMask bits = remaining; bits; bits &= bits - 1) {
+      sums |= sums << volumes_[lowestBit(bits)];
+    }
+    return sums;
+  }
+
+  bool isDeadInBox(const Board &occupied, PieceMask remaining) const {
+    Sums sums = this->sums(remaining);
+    Board empty = all_ & ~occupied;
+    while (empty) {
+      // Flood fill from the first empty cell
+      Board region = Board::bit(lowestBit(empty));
+      Board frontier = region;
+      while (frontier) {
+        Board grown;
+        for (; frontier; frontier.clearLowestBit()) {
+          grown |= neighbors_[lowestBit(frontier)];
+        }
+        frontier = grown & empty & ~region;
+        region |= frontier;
+      }
+      if (!sums[popCount(region)]) {
+        return true;
+      }
+      empty &= ~region;
+    }
+    return false;
+  }
+
+  // isDeadInBox, growing a whole region by a step at once
+  template <int X, int Y, int Z>
+  bool isDeadInFixedBox(const Board &occupied, PieceMask remaining) const {
+    using Geometry = FixedBox<X, Y, Z>;
+    Sums sums = this->sums(remaining);
+    Bitboard empty = Geometry::kAll & ~occupied.words[0];
+    while (empty) {
+      Bitboard region = empty & -empty;
+      Bitboard grown;
+      while ((grown = Geometry::grow(region) & empty) != region) {
+        region = grown;
+      }
+      if (!sums[popCount(region)]) {
+        return true;
+      }
+      empty &= ~region;
+    }
+    return false;
+  }
+
+  template <int X, int Y, int Z> bool useFixedBox(const Box<N> &box) {
+    if (box.x != X || box.y != Y || box.z != Z) {
+      return false;
+    }
+    isDead_ = &RegionPruner::isDeadInFixedBox<X, Y, Z>;
+    return true;
+  }
+
+  std::vector<int> volumes_;
+  std::vector<Board> neighbors_; // The adjacent cells of each cell
+  Board all_;                    // Every cell of the box
+  bool (RegionPruner::*isDead_)(const Board &, PieceMask) const =
+      &RegionPruner::isDeadInBox;
+};
+
+// The number of valid placements covering each cell, kept up to date as
+// placements are pushed and popped, to branch on the most constrained cell.
+// A placement is valid while its piece is not placed and none of its cells
+// is occupied. The counts are also kept by piece, so placing a piece takes
+// its whole column off the counts of the cells at once.
+template <int N> class CellCandidates {
+public:
+  using Board = Occupancy<N>;
+
+  CellCandidates(const Box<N> &box, const PlacementTable<N> &table)
+      : table_(&table), numCells_(box.x * box.y * box.z) {
+    all_ = Board::firstCells(numCells_);
+    int numPieces = table.numPieces;
+    std::vector<std::vector<int>> cover(numCells_);
+    std::vector<std::vector<int>> byPiece(numCells_ * numPieces);
+    for (int q = 0; q < table.placements.size(); ++q) {
+      const Placement<N> &p = table.placements[q];
+      for (Board bits = p.mask; bits; bits.clearLowestBit()) {
+        cover[lowestBit(bits)].push_back(q);
+        byPiece[lowestBit(bits) * numPieces + p.piece].push_back(q);
+      }
+    }
+    for (const auto &list : cover) {
+      coverStart_.push_back(cover_.size());
+      cover_.insert(cover_.end(), list.begin(), list.end());
+      counts_.push_back(list.size());
+    }
+    coverStart_.push_back(cover_.size());
+    pieceCounts_.resize(numPieces * numCells_);
+    for (int cell = 0; cell < numCells_; ++cell) {
+      for (int piece = 0; piece < numPieces; ++piece) {
+        const auto &list = byPiece[cell * numPieces + piece];
+        byPieceStart_.push_back(byPiece_.size());
+        byPiece_.insert(byPiece_.end(), list.begin(), list.end());
+        pieceCounts_[piece * numCells_ + cell] = list.size();
+      }
+    }
+    byPieceStart_.push_back(byPiece_.size());
+    blockers_.resize(table.placements.size(), 0);
+    pushed_.reserve(table.numPieces);
+  }
+
+  // The empty cell with the fewest valid placements, -1 if there is none
+  int mostConstrainedCell(const Board &occupied) const {
+    int best = -1;
+    for (Board empty = all_ & ~occupied; empty; empty.clearLowestBit()) {
+      int cell = lowestBit(empty);
+      if (best < 0 || counts_[cell] < counts_[best]) {
+        best = cell;
+        if (counts_[best] == 0) {
+          break;
+        }
+      }
+    }
+    return best;
+  }
+
+  int count(int cell) const { return counts_[cell]; }
+  bool isValid(int placement) const {
+    return blockers_[placement] == 0 &&
+           !(placed_ >> table_->placements[placement].piece & 1);
+  }
+
+  // The placements covering a cell, as indices into the placement table
+  const int *coverBegin(int cell) const {
+    return cover_.data() + coverStart_[cell];
+  }
+  const int *coverEnd(int cell) const {
+    return cover_.data() + coverStart_[cell + 1];
+  }
+
+  void push(int placement) {
+    const Placement<N> &p = table_->placements[placement];
+    addColumn(p.piece, -1);
+    placed_ |= PieceMask{1} << p.piece;
+    occupy(p.mask, 1);
+    pushed_.push_back(placement);
+  }
+
+  void pop() {
+    const Placement<N> &p = table_->placements[pushed_.back()];
+    occupy(p.mask, -1);
+    placed_ &= ~(PieceMask{1} << p.piece);
+    addColumn(p.piece, 1);
+    pushed_.pop_back();
+  }
+
+  // Pop everything pushed so far
+  void reset() {
+    while (!pushed_.empty()) {
+      pop();
+    }
+  }
+
+private:
+  // Add sign times the counts of piece to the counts of the cells
+  void addColumn(int piece, int sign) {
+    const int *column = pieceCounts_.data() + piece * numCells_;
+    for (int cell = 0; cell < numCells_; ++cell) {
+      counts_[cell] += sign * column[cell];
+    }
+  }
+
+  // Add delta to the blockers of every placement of a piece not placed that
+  // covers a cell of mask. The placements of a placed piece are left alone:
+  // whatever is pushed after the piece is popped before it, so they are back
+  // as they were by the time it is popped.
+  void occupy(const Board &mask, int delta) {
+    const int numPieces = table_->numPieces;
+    for (Board bits = mask; bits; bits.clearLowestBit()) {
+      const int *start = byPieceStart_.data() + lowestBit(bits) * numPieces;
+      for (PieceMask left = table_->allPieces() & ~placed_; left;
+           left &= left - 1) {
+        int piece = lowestBit(left);
+        for (int i = start[piece]; i < start[piece + 1]; ++i) {
+          block(byPiece_[i], piece, delta);
+        }
+      }
+    }
+  }
+
+  void block(int placement, int piece, int delta) {
+    int before = blockers_[placement];
+    blockers_[placement] += delta;
+    // Only a change between valid and ruled out changes the counts
+    if (before == 0 || blockers_[placement] == 0) {
+      int *column = pieceCounts_.data() + piece * numCells_;
+      for (Board bits = table_->placements[placement].mask; bits;
+           bits.clearLowestBit()) {
+        int cell = lowestBit(bits);
+        column[cell] -= delta;
+        counts_[cell] -= delta;
+      }
+    }
+  }
+
+  const PlacementTable<N> *table_;
+  int numCells_;
+  Board all_;
+  std::vector<int> coverStart_; // Offset of each cell's list in cover_
+  std::vector<int> cover_;      // Placements covering each cell
+  std::vector<int> counts_;     // Valid placements covering each cell
+  // Offset of each (cell, piece) list in byPiece_, the placements of the
+  // piece covering the cell
+  std::vector<int> byPieceStart_;
+  std::vector<int> byPiece_;
+  // Placements of each piece covering each cell that no occupied cell rules
+  // out, by piece and then by cell, as of its placing for a placed piece
+  std::vector<int> pieceCounts_;
+  // Occupied cells ruling each placement out, as of its piece's placing
+  std::vector<int> blockers_;
+  PieceMask placed_ = 0;
+  std::vector<int> pushed_;
+};
+
+// Fixed-size hash table of subtree solution counts, keyed by the occupancy
+// and the remaining pieces, shared by all threads without locks. A slot is
+// simply overwritten by the next subtree hashing to it. Every slot has a
+// sequence number that is odd while the slot is being written: a writer
+// that cannot claim a slot skips the store, and a reader that sees the
+// number change while reading treats the slot as a miss. A count of 0
+// records a subtree known to have no solution.
+template <int N> class TranspositionTable {
+public:
+  using Board = Occupancy<N>;
+
+  explicit TranspositionTable(int log2Slots)
+      : slots_(new Slot[size_t{1} << log2Slots]),
+        mask_((size_t{1} << log2Slots) - 1) {}
+
+  bool find(const Board &occupied, PieceMask remaining,
+            uint64_t &count) const {
+    const Slot &slot = slots_[index(occupied, remaining)];
+    uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      return false;
+    }
+    Board slotOccupied;
+    for (int i = 0; i < N; ++i) {
+      slotOccupied.words[i] = slot.occupied[i].load(std::memory_order_relaxed);
+    }
+    PieceMask slotRemaining = slot.remaining.load(std::memory_order_relaxed);
+    uint64_t slotCount = slot.count.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != seq ||
+        slotOccupied != occupied || slotRemaining != remaining) {
+      return false;
+    }
+    count = slotCount;
+    return true;
+  }
+
+  void store(const Board &occupied, PieceMask remaining, uint64_t count) {
+    Slot &slot = slots_[index(occupied, remaining)];
+    uint64_t seq = slot.seq.load(std::memory_order_relaxed);
+    if ((seq & 1) || !slot.seq.compare_exchange_strong(
+                         seq, seq + 1, std::memory_order_acquire)) {
+      return;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < N; ++i) {
+      slot.occupied[i].store(occupied.words[i], std::memory_order_relaxed);
+    }
+    slot.remaining.store(remaining, std::memory_order_relaxed);
+    slot.count.store(count, std::memory_order_relaxed);
+    slot.seq.store(seq + 2, std::memory_order_release);
+  }
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<Bitboard> occupied[N] = {};
+    std::atomic<PieceMask> remaining{0}; // 0 for an empty slot
+    std::atomic<uint64_t> count{0};
+  };
+
+  size_t index(const Board &occupied, PieceMask remaining) const {
+    // splitmix64 finalizer
+    uint64_t h = occupied.hash() ^ (remaining * 0x9e3779b97f4a7c15);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+    return (h ^ (h >> 31)) & mask_;
+  }
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_;
+};
+
+// Counters of the search at one depth, the number of pieces placed. Only
+// kept when built with PACK_INSTRUMENT defined.
+struct DepthStats {
+  uint64_t nodes = 0;        // Nodes visited
+  uint64_t attempts = 0;     // Placements tried at the nodes
+  uint64_t placements = 0;   // Placements that fit
+  uint64_t regionPrunes = 0; // Placements cut by the RegionPruner
+  uint64_t cellPrunes = 0;   // Nodes with an empty cell nothing can cover
+  uint64_t cacheHits = 0;    // Nodes counted from the TranspositionTable
+  uint64_t solutions = 0;    // Nodes with every piece placed
+
+  void merge(const DepthStats &other) {
+    nodes += other.nodes;
+    attempts += other.attempts;
+    placements += other.placements;
+    regionPrunes += other.regionPrunes;
+    cellPrunes += other.cellPrunes;
+    cacheHits += other.cacheHits;
+    solutions += other.solutions;
+  }
+};
+
+// Counters of a search, kept per thread
+struct SearchStats {
+  uint64_t nodes = 0;        // Placements pushed
+  uint64_t regionPrunes = 0; // Nodes cut by the RegionPruner
+  uint64_t cellPrunes = 0;   // Nodes with an empty cell nothing can cover
+  uint64_t cacheHits = 0;    // Subtrees counted from the TranspositionTable
+#if defined(PACK_INSTRUMENT)
+  std::vector<DepthStats> depths;
+
+  DepthStats &atDepth(int depth) {
+    if (depth >= depths.size()) {
+      depths.resize(depth + 1);
+    }
+    return depths[depth];
+  }
+#endif
+
+  void merge(const SearchStats &other) {
+    nodes += other.nodes;
+    regionPrunes += other.regionPrunes;
+    cellPrunes += other.cellPrunes;
+    cacheHits += other.cacheHits;
+#if defined(PACK_INSTRUMENT)
+    for (int d = 0; d < other.depths.size(); ++d) {
+      atDepth(d).merge(other.depths[d]);
+    }
+#endif
+  }
+};
+
+// Count an event of the search at a depth, as in
+// PACK_COUNT(ctx.stats, level, attempts), or n of them with PACK_ADD. Expands
+// to nothing, without evaluating n, unless built with PACK_INSTRUMENT defined.
+#if defined(PACK_INSTRUMENT)
+#define PACK_ADD(stats, depth, counter, n)                                     \
+  ((stats).atDepth(depth).counter += (n))
+#else
+#define PACK_ADD(stats, depth, counter, n) ((void)0)
+#endif
+#define PACK_COUNT(stats, depth, counter) PACK_ADD(stats, depth, counter, 1)
+
+#if defined(PACK_INSTRUMENT)
+// Print the counters of every depth as a table
+inline void printDepthStats(std::ostream &out, const SearchStats &stats) {
+  out << "depth      nodes   attempts placements     region       cell"
+         "      cache  solutions"
+      << std::endl;
+  for (int d = 0; d < stats.depths.size(); ++d) {
+    const DepthStats &s = stats.depths[d];
+    out << std::setw(5) << d;
+    for (uint64_t n : {s.nodes, s.attempts, s.placements, s.regionPrunes,
+                       s.cellPrunes, s.cacheHits, s.solutions}) {
+      out << std::setw(11) << n;
+    }
+    out << std::endl;
+  }
+}
+
+// Write the counters of every depth as a JSON array of objects
+inline void writeDepthStatsJson(std::ostream &out, const SearchStats &stats) {
+  out << "[";
+  for (int d = 0; d < stats.depths.size(); ++d) {
+    const DepthStats &s = stats.depths[d];
+    out << (d ? ", " : "") << "{\"depth\": " << d << ", \"nodes\": " << s.nodes
+        << ", \"attempts\": " << s.attempts
+        << ", \"placements\": " << s.placements
+        << ", \"region_prunes\": " << s.regionPrunes
+        << ", \"cell_prunes\": " << s.cellPrunes
+        << ", \"cache_hits\": " << s.cacheHits
+        << ", \"solutions\": " << s.solutions << "}";
+  }
+  out << "]";
+}
+#endif
+
+// What a search runs on: the placements, the optional pruning and subtree
+// cache, shared by all threads, and the branching state and counters of the
+// thread running it. Copying a context gives another thread its own state.
+template <int N> struct SearchContext {
+  const PlacementTable<N> *table;
+  const RegionPruner<N> *pruner = nullptr;
+  TranspositionTable<N> *cache = nullptr; // Only used by countSolutions
+  // Set to branch on the most constrained cell instead of the first empty one
+  std::optional<CellCandidates<N>> candidates;
+  SearchStats stats;
+};
+
+template <int N, typename Visitor>
+bool searchNextCellPiece(int level, SearchContext<N> &ctx, PieceMask remaining,
+                         Box<N> &box, Visitor &visit) {
+  const PlacementTable<N> &table = *ctx.table;
+
+  PACK_COUNT(ctx.stats, level, nodes);
+  // Found a solution
+  if (!remaining) {
+    PACK_COUNT(ctx.stats, level, solutions);
+    return visit(static_cast<const Box<N> &>(box));
+  }
+
+  // Find next empty cell in the box
+  int cell = box.firstEmptyCell();
+
+  // Test every placement anchored at the empty cell at once, then try the
+  // ones that fit in order, skipping the pieces not placeable here
+  PieceMask placeable = table.placeable(remaining);
+  PACK_ADD(ctx.stats, level, attempts, table.numPlacements(cell, placeable));
+  const int cellEnd = table.cellEnd(cell);
+  for (int chunk = table.cellBegin(cell); chunk < cellEnd; chunk += 64) {
+    uint64_t fits =
+        table.fitting(chunk, std::min(64, cellEnd - chunk), box.occupied);
+    for (; fits; fits &= fits - 1) {
+      const Placement<N> *p = &table.placements[chunk + lowestBit(fits)];
+      if (!(placeable >> p->piece & 1)) {
+        continue;
+      }
+      // Remove the piece from the remaining pieces
+      PieceMask newRemaining = remaining & ~(PieceMask{1} << p->piece);
+      box.pushPiece(*p);
+      ++ctx.stats.nodes;
+      PACK_COUNT(ctx.stats, level, placements);
+      if (ctx.pruner && ctx.pruner->isDead(box.occupied, newRemaining)) {
+        ++ctx.stats.regionPrunes;
+        PACK_COUNT(ctx.stats, level, regionPrunes);
+        box.popPiece();
+        continue;
+      }
+      // search for the next piece
+      bool more =
+          searchNextCellPiece(level + 1, ctx, newRemaining, box, visit);
+      // Pop the piece
+      box.popPiece();
+      if (!more) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// The search of searchNextCellPiece, but branching on the empty cell with the
+// fewest valid placements (ctx.candidates) over every placement covering it.
+// A cell that no placement can cover ends the branch at once.
+template <int N, typename Visitor>
+bool searchMostConstrainedCell(int level, SearchContext<N> &ctx,
+                               PieceMask remaining, Box<N> &box,
+                               Visitor &visit) {
+  PACK_COUNT(ctx.stats, level, nodes);
+  // Found a solution
+  if (!remaining) {
+    PACK_COUNT(ctx.stats, level, solutions);
+    return visit(static_cast<const Box<N> &>(box));
+  }
+
+  CellCandidates<N> &candidates = *ctx.candidates;
+  int cell = candidates.mostConstrainedCell(box.occupied);
+  if (cell < 0) {
+    return true;
+  }
+  if (candidates.count(cell) == 0) {
+    ++ctx.stats.cellPrunes;
+    PACK_COUNT(ctx.stats, level, cellPrunes);
+    return true;
+  }
+
+  PieceMask placeable = ctx.table->placeable(remaining);
+  const int *end = candidates.coverEnd(cell);
+  for (const int *q = candidates.coverBegin(cell); q != end; ++q) {
+    const Placement<N> &p = ctx.table->placements[*q];
+    PACK_COUNT(ctx.stats, level, attempts);
+    if (!candidates.isValid(*q) || !(placeable >> p.piece & 1)) {
+      continue;
+    }
+    PieceMask newRemaining = remaining & ~(PieceMask{1} << p.piece);
+    box.pushPiece(p);
+    candidates.push(*q);
+    ++ctx.stats.nodes;
+    PACK_COUNT(ctx.stats, level, placements);
+    bool more = true;
+    if (ctx.pruner && ctx.pruner->isDead(box.occupied, newRemaining)) {
+      ++ctx.stats.regionPrunes;
+      PACK_COUNT(ctx.stats, level, regionPrunes);
+    } else {
+      more =
+          searchMostConstrainedCell(level + 1, ctx, newRemaining, box, visit);
+    }
+    candidates.pop();
+    box.popPiece();
+    if (!more) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Search below the current node of box with the branching chosen in ctx.
+// The branching state must already reflect the pieces in box.
+template <int N, typename Visitor>
+bool searchBox(int level, SearchContext<N> &ctx, PieceMask remaining,
+               Box<N> &box, Visitor &visit) {
+  if (ctx.candidates) {
+    return searchMostConstrainedCell(level, ctx, remaining, box, visit);
+  }
+  return searchNextCellPiece(level, ctx, remaining, box, visit);
+}
+
+// Count the solutions below the current node of box without visiting them,
+// weighting each by its placements like SolutionSink does. Takes the same
+// branching as searchBox, and reuses the counts of subtrees already solved
+// through ctx.cache when there is one.
+template <int N>
+uint64_t countSolutions(SearchContext<N> &ctx, PieceMask remaining,
+                               Box<N> &box) {
+  [[maybe_unused]] int level = box.pieces.size();
+  PACK_COUNT(ctx.stats, level, nodes);
+  if (!remaining) {
+    PACK_COUNT(ctx.stats, level, solutions);
+    return 1;
+  }
+  uint64_t count = 0;
+  if (ctx.cache && ctx.cache->find(box.occupied, remaining, count)) {
+    ++ctx.stats.cacheHits;
+    PACK_COUNT(ctx.stats, level, cacheHits);
+    return count;
+  }
+
+  const PlacementTable<N> &table = *ctx.table;
+  auto countChild = [&](const Placement<N> &p) {
+    PieceMask newRemaining = remaining & ~(PieceMask{1} << p.piece);
+    ++ctx.stats.nodes;
+    PACK_COUNT(ctx.stats, level, placements);
+    if (ctx.pruner && ctx.pruner->isDead(box.occupied, newRemaining)) {
+      ++ctx.stats.regionPrunes;
+      PACK_COUNT(ctx.stats, level, regionPrunes);
+      return;
+    }
+    count += p.weight * countSolutions(ctx, newRemaining, box);
+  };
+
+  if (ctx.candidates) {
+    CellCandidates<N> &candidates = *ctx.candidates;
+    int cell = candidates.mostConstrainedCell(box.occupied);
+    if (cell >= 0 && candidates.count(cell) == 0) {
+      ++ctx.stats.cellPrunes;
+      PACK_COUNT(ctx.stats, level, cellPrunes);
+    } else if (cell >= 0) {
+      PieceMask placeable = table.placeable(remaining);
+      const int *end = candidates.coverEnd(cell);
+      for (const int *q = candidates.coverBegin(cell); q != end; ++q) {
+        PACK_COUNT(ctx.stats, level, attempts);
+        if (candidates.isValid(*q) &&
+            (placeable >> table.placements[*q].piece & 1)) {
+          box.pushPiece(table.placements[*q]);
+          candidates.push(*q);
+          countChild(table.placements[*q]);
+          candidates.pop();
+          box.popPiece();
+        }
+      }
+    }
+  } else {
+    int cell = box.firstEmptyCell();
+    PieceMask placeable = table.placeable(remaining);
+    PACK_ADD(ctx.stats, level, attempts, table.numPlacements(cell, placeable));
+    const int cellEnd = table.cellEnd(cell);
+    for (int chunk = table.cellBegin(cell); chunk < cellEnd; chunk += 64) {
+      uint64_t fits =
+          table.fitting(chunk, std::min(64, cellEnd - chunk), box.occupied);
+      for (; fits; fits &= fits - 1) {
+        const Placement<N> &p = table.placements[chunk + lowestBit(fits)];
+        if (placeable >> p.piece & 1) {
+          box.pushPiece(p);
+          countChild(p);
+          box.popPiece();
+        }
+      }
+    }
+  }
+
+  if (ctx.cache) {
+    ctx.cache->store(box.occupied, remaining, count);
+  }
+  return count;
+}
+
+// The same depth-first search as searchNextCellPiece, driven by an explicit
+// stack of frames instead of recursion. Frame k is the node with k pieces
+// placed: the empty cell it fills, the cursor into the placements anchored at
+// that cell, and the pieces still to place. The stack is allocated once, so
+// the search can be run for a bounded number of nodes and resumed later,
+// copied as a snapshot, or have its unexplored siblings split off into
+// another search for another worker.
+template <int N> class IterativeSearch {
+public:
+  enum class Status {
+    Done,    // The whole tree has been searched
+    Paused,  // The node budget ran out
+    Stopped, // The visitor returned false
+  };
+
+  IterativeSearch(const Box<N> &box, const SearchContext<N> &ctx)
+      : box_(box), ctx_(ctx), table_(ctx.table),
+        stack_(ctx.table->numPieces + 1) {
+    stack_[0] = frameAt(table_->allPieces());
+    PACK_COUNT(ctx_.stats, 0, nodes);
+  }
+
+  const Box<N> &box() const { return box_; }
+  const SearchStats &stats() const { return ctx_.stats; }
+
+  // Search until the tree is exhausted, visit returns false or maxNodes more
+  // nodes have been visited. A paused or stopped search carries on from where
+  // it left off on the next call.
+  template <typename Visitor>
+  Status run(Visitor &visit, uint64_t maxNodes = UINT64_MAX) {
+    const std::vector<Placement<N>> &placements = table_->placements;
+    for (uint64_t budget = maxNodes; budget; --budget) {
+      Frame &f = stack_[depth_];
+      // Next placement that fits, skipping the pieces already placed and
+      // the copies that have to wait for their previous copy
+      const Placement<N> *p = nullptr;
+      PieceMask placeable = table_->placeable(f.remaining);
+      while (f.cursor < f.end) {
+        const Placement<N> &candidate = placements[f.cursor];
+        if (!(placeable >> candidate.piece & 1)) {
+          f.cursor = table_->start[f.cell * table_->numPieces +
+                                   candidate.piece + 1];
+          continue;
+        }
+        ++f.cursor;
+        PACK_COUNT(ctx_.stats, depth_, attempts);
+        if (box_.canPush(candidate.mask)) {
+          p = &candidate;
+          break;
+        }
+      }
+
+      // No more placements at this node, backtrack
+      if (!p) {
+        if (depth_ == 0) {
+          return Status::Done;
+        }
+        --depth_;
+        box_.popPiece();
+        continue;
+      }
+
+      ++ctx_.stats.nodes;
+      PACK_COUNT(ctx_.stats, depth_, placements);
+      box_.pushPiece(*p);
+      PieceMask remaining = f.remaining & ~(PieceMask{1} << p->piece);
+      if (ctx_.pruner && remaining &&
+          ctx_.pruner->isDead(box_.occupied, remaining)) {
+        ++ctx_.stats.regionPrunes;
+        PACK_COUNT(ctx_.stats, depth_, regionPrunes);
+        box_.popPiece();
+        continue;
+      }
+      PACK_COUNT(ctx_.stats, depth_ + 1, nodes);
+      if (!remaining) {
+        PACK_COUNT(ctx_.stats, depth_ + 1, solutions);
+        bool more = visit(static_cast<const Box<N> &>(box_));
+        box_.popPiece();
+        if (!more) {
+          return Status::Stopped;
+        }
+        continue;
+      }
+      stack_[++depth_] = frameAt(remaining);
+    }
+    return Status::Paused;
+  }
+
+  // Hand the untried siblings of the shallowest node that has any over to
+  // other, which becomes a search of just those subtrees. This search will
+  // no longer visit them. Returns false if there is nothing to hand off.
+  bool split(IterativeSearch &other);
+
+private:
+  struct Frame {
+    int cell;
+    int cursor;
+    int end;
+    PieceMask remaining;
+  };
+
+  // Frame for the node that places remaining at the first empty cell
+  Frame frameAt(PieceMask remaining) {
+    int cell = box_.firstEmptyCell();
+    if (cell < 0) {
+      return {0, 0, 0, remaining};
+    }
+    int n = table_->numPieces;
+    return {cell, table_->start[cell * n], table_->start[cell * n + n],
+            remaining};
+  }
+
+  Box<N> box_;
+  SearchContext<N> ctx_;
+  const PlacementTable<N> *table_;
+  std::vector<Frame> stack_;
+  int depth_ = 0;
+};
+
+template <int N> bool IterativeSearch<N>::split(IterativeSearch &other) {
+  for (int d = 0; d <= depth_; ++d) {
+    Frame &f = stack_[d];
+    if (f.cursor == f.end) {
+      continue;
+    }
+    // other starts from the same prefix, with nothing left to try above d
+    other = IterativeSearch(*this);
+    while (other.box_.pieces.size() > d) {
+      other.box_.popPiece();
+    }
+    for (int i = 0; i < d; ++i) {
+      other.stack_[i].cursor = other.stack_[i].end;
+    }
+    other.depth_ = d;
+    other.ctx_.stats = {};
+    f.end = f.cursor;
+    return true;
+  }
+  return false;
+}
+
+// The size of a search tree as predicted by estimateTree
+struct TreeEstimate {
+  double nodes = 0;     // Placements pushed, as counted by SearchStats
+  double solutions = 0; // Solutions reached, without their weights
+  double seconds = 0;   // Time to search the tree
+};
+
+// Estimate the tree searchNextCellPiece walks from box with Knuth's random
+// probes. A probe follows a single path down from the root, taking one of the
+// d placements that fit at each node at random, and stands for the d1 * ...
+// * dk nodes at depth k of the path. The mean over numProbes probes is an
+// unbiased estimate, which needs more probes the more lopsided the tree is.
+// The time is the estimated nodes at the rate of a short IterativeSearch run.
+template <int N>
+TreeEstimate estimateTree(const SearchContext<N> &ctx, const Box<N> &start,
+                                 int numProbes, uint64_t seed = 1) {
+  const PlacementTable<N> &table = *ctx.table;
+  std::mt19937_64 random(seed);
+  std::vector<const Placement<N> *> fits;
+  TreeEstimate estimate;
+  for (int probe = 0; probe < numProbes; ++probe) {
+    Box<N> box = start;
+    PieceMask remaining = table.allPieces();
+    double paths = 1;
+    while (remaining) {
+      int cell = box.firstEmptyCell();
+      fits.clear();
+      for (PieceMask bits = table.placeable(remaining); bits;
+           bits &= bits - 1) {
+        int piece = lowestBit(bits);
+        const Placement<N> *end = table.end(cell, piece);
+        for (const Placement<N> *p = table.begin(cell, piece); p != end; ++p) {
+          if (box.canPush(p->mask)) {
+            fits.push_back(p);
+          }
+        }
+      }
+      if (fits.empty()) {
+        break;
+      }
+      paths *= fits.size();
+      estimate.nodes += paths / numProbes;
+      std::uniform_int_distribution<size_t> pick(0, fits.size() - 1);
+      const Placement<N> &p = *fits[pick(random)];
+      box.pushPiece(p);
+      remaining &= ~(PieceMask{1} << p.piece);
+      if (ctx.pruner && ctx.pruner->isDead(box.occupied, remaining)) {
+        paths = 0; // A dead end, even with no pieces left
+        break;
+      }
+    }
+    if (!remaining) {
+      estimate.solutions += paths / numProbes;
+    }
+  }
+
+  // Time the first nodes of the search itself, as a probe skips its pushes
+  const uint64_t kTimedNodes = 1 << 16;
+  IterativeSearch<N> search(start, ctx);
+  auto visit = [](const Box<N> &) { return true; };
+  auto startTime = std::chrono::steady_clock::now();
+  search.run(visit, kTimedNodes);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - startTime;
+  if (search.stats().nodes) {
+    estimate.seconds =
+        elapsed.count() / search.stats().nodes * estimate.nodes;
+  }
+  return estimate;
+}
+
+// Exact cover solver using Knuth's Dancing Links (Algorithm X). There is one
+// column per cell of the box followed by one column per piece, and one row
+// per placement in the placement table. The copies of a piece share a single
+// column, which takes as many rows as there are copies, and the rows of the
+// first copy only: copies are never told apart, so a packing is not found
+// once per permutation of them. At every step the column with the fewest
+// remaining rows is covered first, among those that take a single row. The
+// columns of blocked cells are covered from the start.
+template <int N> class DancingLinks {
+public:
+  DancingLinks(const Box<N> &box, const PlacementTable<N> &table)
+      : box_(box), table_(table) {
+    int numCells = box.x * box.y * box.z;
+    // The piece column of each piece, shared by its copies
+    std::vector<int> pieceColumns;
+    int numColumns = numCells;
+    for (int i = 0; i < table.numPieces; ++i) {
+      numColumns += !(table.copies >> i & 1);
+      pieceColumns.push_back(numColumns);
+    }
+    // Node 0 is the root, nodes 1..numColumns are the column headers
+    for (int c = 0; c <= numColumns; ++c) {
+      int left = c == 0 ? numColumns : c - 1;
+      int right = c == numColumns ? 0 : c + 1;
+      nodes_.push_back({left, right, c, c, c, -1});
+    }
+    size_.resize(numColumns + 1, 0);
+    need_.resize(numColumns + 1, 1);
+    for (int i = 0; i < table.numPieces; ++i) {
+      need_[pieceColumns[i]] += (table.copies >> i & 1);
+    }
+    for (int row = 0; row < table.placements.size(); ++row) {
+      const Placement<N> &p = table.placements[row];
+      if (table.copies >> p.piece & 1) {
+        continue;
+      }
+      int first = nodes_.size();
+      for (Occupancy<N> bits = p.mask; bits; bits.clearLowestBit()) {
+        appendNode(first, 1 + lowestBit(bits), row);
+      }
+      appendNode(first, pieceColumns[p.piece], row);
+    }
+    for (Occupancy<N> bits = box.occupied; bits; bits.clearLowestBit()) {
+      cover(1 + lowestBit(bits));
+    }
+    rows_.reserve(table.numPieces);
+  }
+
+  const SearchStats &stats() const { return stats_; }
+
+  // Report every exact cover to visit, see searchNextCellPiece
+  template <typename Visitor> bool search(Visitor &visit) {
+    [[maybe_unused]] int level = rows_.size();
+    PACK_COUNT(stats_, level, nodes);
+    // All columns covered, found a solution
+    if (nodes_[0].right == 0) {
+      PACK_COUNT(stats_, level, solutions);
+      return report(visit);
+    }
+
+    // Choose the column with the fewest rows. Branching on the column of
+    // copies would tell them apart.
+    int column = 0;
+    for (int c = nodes_[0].right; c != 0; c = nodes_[c].right) {
+      if (need_[c] == 1 && (column == 0 || size_[c] < size_[column])) {
+        column = c;
+      }
+    }
+    if (column == 0 || size_[column] == 0) {
+      ++stats_.cellPrunes;
+      PACK_COUNT(stats_, level, cellPrunes);
+      return true;
+    }
+
+    cover(column);
+    bool more = true;
+    for (int r = nodes_[column].down; more && r != column;
+         r = nodes_[r].down) {
+      PACK_COUNT(stats_, level, attempts);
+      rows_.push_back(nodes_[r].row);
+      ++stats_.nodes;
+      PACK_COUNT(stats_, level, placements);
+      // A column is covered once it has taken all the rows it needs
+      for (int j = nodes_[r].right; j != r; j = nodes_[j].right) {
+        if (--need_[nodes_[j].column] == 0) {
+          cover(nodes_[j].column);
+        }
+      }
+      more = search(visit);
+      for (int j = nodes_[r].left; j != r; j = nodes_[j].left) {
+        if (need_[nodes_[j].column]++ == 0) {
+          uncover(nodes_[j].column);
+        }
+      }
+      rows_.pop_back();
+    }
+    uncover(column);
+    return more;
+  }
+
+private:
+  // Visit the solution of rows_. The rows of copies are all placements of
+  // the first copy, they are given to the copies in the order of their
+  // anchor cells as in the other engines.
+  template <typename Visitor> bool report(Visitor &visit) {
+    for (int row : rows_) {
+      const Placement<N> *p = &table_.placements[row];
+      int anchor = lowestBit(p->mask);
+      int piece = p->piece;
+      for (int other : rows_) {
+        const Placement<N> &q = table_.placements[other];
+        piece += q.piece == p->piece && lowestBit(q.mask) < anchor;
+      }
+      if (piece != p->piece) {
+        const Placement<N> *end = table_.end(anchor, piece);
+        p = table_.begin(anchor, piece);
+        while (p != end && p->mask != table_.placements[row].mask) {
+          ++p;
+        }
+        assert(p != end);
+      }
+      box_.pushPiece(*p);
+    }
+    bool more = visit(static_cast<const Box<N> &>(box_));
+    for (size_t i = 0; i < rows_.size(); ++i) {
+      box_.popPiece();
+    }
+    return more;
+  }
+
+  struct Node {
+    int left;
+    int right;
+    int up;
+    int down;
+    int column;
+    int row;
+  };
+
+  // Append a node for row to the bottom of column, linking it into the row
+  // that starts at node first
+  void appendNode(int first, int column, int row) {
+    int n = nodes_.size();
+    int left = n == first ? n : n - 1;
+    int right = n == first ? n : first;
+    nodes_.push_back({left, right, nodes_[column].up, column, column, row});
+    nodes_[left].right = n;
+    nodes_[right].left = n;
+    nodes_[nodes_[column].up].down = n;
+    nodes_[column].up = n;
+    ++size_[column];
+  }
+
+  void cover(int column) {
+    nodes_[nodes_[column].right].left = nodes_[column].left;
+    nodes_[nodes_[column].left].right = nodes_[column].right;
+    for (int i = nodes_[column].down; i != column; i = nodes_[i].down) {
+      for (int j = nodes_[i].right; j != i; j = nodes_[j].right) {
+        nodes_[nodes_[j].down].up = nodes_[j].up;
+        nodes_[nodes_[j].up].down = nodes_[j].down;
+        --size_[nodes_[j].column];
+      }
+    }
+  }
+
+  void uncover(int column) {
+    for (int i = nodes_[column].up; i != column; i = nodes_[i].up) {
+      for (int j = nodes_[i].left; j != i; j = nodes_[j].left) {
+        ++size_[nodes_[j].column];
+        nodes_[nodes_[j].down].up = j;
+        nodes_[nodes_[j].up].down = j;
+      }
+    }
+    nodes_[nodes_[column].right].left = column;
+    nodes_[nodes_[column].left].right = column;
+  }
+
+  Box<N> box_; // Takes the pieces of a solution while it is visited
+  const PlacementTable<N> &table_;
+  std::vector<Node> nodes_;
+  std::vector<int> size_; // Number of rows in each column
+  std::vector<int> need_; // Rows each column still takes
+  std::vector<int> rows_; // The rows of the partial solution
+  SearchStats stats_;
+};
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "box.h"
+#include "puzzle.h"
+#include "search.h"
+
+// First bytes of a solution file
+const char kSolutionMagic[4] = {'P', 'K', 'S', 'L'};
+
+// A solution file holds the solutions of one puzzle, appended by
+// SolutionWriter and read back by SolutionStore. Little endian:
+//
+//   kSolutionMagic, u32 size of the header, u8 bytes of a placement index,
+//   u8 placements in a solution, u32 number of placements, u8 symmetry: 0
+//   if every solution is kept, else the order of the rotation group of the
+//   box, of which only canonical solutions are kept (BoxSymmetry),
+//   the puzzle as a binary puzzle file, kPuzzleMagic and one record, with
+//   the size of the box searched,
+//   for each placement u8 piece, u8 orientation, u8 x, y, z,
+//
+// then the solutions up to the end of the file, each the index of every
+// placement it is made of, in the order they were placed. The orientations
+// of a piece are numbered as in puzzleOrients().
+constexpr int kSolutionHeaderBytes = 15; // Up to the puzzle
+constexpr int kPlacementRecordBytes = 5;
+
+// Append the n low bytes of value to bytes, lowest first
+inline void putLittleEndian(std::string &bytes, uint32_t value, int n) {
+  for (int i = 0; i < n; ++i) {
+    bytes.push_back(value >> (8 * i) & 0xff);
+  }
+}
+
+inline uint32_t getLittleEndian(const unsigned char *bytes, int n) {
+  uint32_t value = 0;
+  for (int i = 0; i < n; ++i) {
+    value |= uint32_t{bytes[i]} << (8 * i);
+  }
+  return value;
+}
+
+// Append the solutions of a search to a solution file, each encoded as the
+// indices of its placements in the table of every placement of the box
+template <int N> class SolutionWriter {
+public:
+  // table has every placement of pieces, the orientations of puzzle in box:
+  // it is the table before any BoxSymmetry::restrict. symmetry is the
+  // BoxSymmetry whose canonical solutions are added, null if all of them are.
+  SolutionWriter(const Puzzle &puzzle, const Box<N> &box,
+                 const PlacementTable<N> &table,
+                 const std::vector<PieceOrients> &pieces,
+                 const BoxSymmetry<N> *symmetry)
+      : table_(table) {
+    uint64_t numPlacements = table.placements.size();
+    while (indexBytes_ < 4 && numPlacements > uint64_t{1}
+                                                  << (8 * indexBytes_)) {
+      ++indexBytes_;
+    }
+    Puzzle searched = puzzle;
+    searched.size = {box.x, box.y, box.z};
+    std::ostringstream binary;
+    binary.write(kPuzzleMagic, sizeof(kPuzzleMagic));
+    fits_ = writePuzzle(binary, searched);
+
+    std::string placements;
+    for (const Placement<N> &p : table.placements) {
+      putLittleEndian(placements, p.piece, 1);
+      putLittleEndian(placements, p.orient - pieces[p.piece].data(), 1);
+      putLittleEndian(placements, p.pos.x, 1);
+      putLittleEndian(placements, p.pos.y, 1);
+      putLittleEndian(placements, p.pos.z, 1);
+    }
+    header_.assign(kSolutionMagic, sizeof(kSolutionMagic));
+    putLittleEndian(header_,
+                    kSolutionHeaderBytes + binary.str().size() +
+                        placements.size(),
+                    4);
+    putLittleEndian(header_, indexBytes_, 1);
+    putLittleEndian(header_, table.numPieces, 1);
+    putLittleEndian(header_, numPlacements, 4);
+    putLittleEndian(header_, symmetry ? symmetry->order() : 0, 1);
+    header_ += binary.str() + placements;
+  }
+
+  // Open path to append to, writing the header if it is new or empty. Fails
+  // if path holds the solutions of another puzzle, placement table or
+  // symmetry.
+  bool open(const std::string &path) {
+    if (!fits_) {
+      return fail("the box does not fit the binary puzzle format");
+    }
+    std::ifstream in(path, std::ios::binary);
+    std::string existing(header_.size(), '\0');
+    bool isNew = !in || in.peek() == EOF;
+    if (!isNew && (!in.read(&existing[0], existing.size()) ||
+                   existing != header_)) {
+      return fail(path + " holds solutions of another puzzle or box, or"
+                         " with another --symmetry");
+    }
+    out_.open(path, std::ios::binary | std::ios::app);
+    if (isNew) {
+      out_ << header_;
+    }
+    if (!out_) {
+      return fail("cannot write " + path);
+    }
+    return true;
+  }
+
+  void add(const Box<N> &box) {
+    record_.clear();
+    for (const auto &piece : box.pieces) {
+      putLittleEndian(record_, indexOf(piece), indexBytes_);
+    }
+    out_.write(record_.data(), record_.size());
+    ++count_;
+  }
+
+  // Flush the solutions, false if any could not be written
+  bool close() {
+    out_.close();
+    return out_ || fail("cannot write the solutions");
+  }
+
+  // Solutions added since open()
+  uint64_t count() const { return count_; }
+
+  // Why open() or close() failed
+  const std::string &error() const { return error_; }
+
+private:
+  uint32_t indexOf(const PiecePos<N> &piece) const {
+    int cell = lowestBit(piece.mask);
+    for (int i = table_.cellBegin(cell); i < table_.cellEnd(cell); ++i) {
+      const Placement<N> &p = table_.placements[i];
+      if (p.orient == piece.piece && p.mask == piece.mask) {
+        return i;
+      }
+    }
+    assert(!"a piece not in the placement table");
+    return 0;
+  }
+
+  bool fail(const std::string &message) {
+    error_ = message;
+    return false;
+  }
+
+  PlacementTable<N> table_;
+  int indexBytes_ = 1;
+  bool fits_;
+  std::string header_;
+  std::string record_; // The solution being written
+  std::ofstream out_;
+  uint64_t count_ = 0;
+  std::string error_;
+};
+
+// The solutions of a solution file, mapped into memory rather than read. Only
+// the header is parsed on open(), a solution is decoded when asked for.
+class SolutionStore {
+public:
+  SolutionStore() = default;
+  SolutionStore(const SolutionStore &) = delete;
+  SolutionStore &operator=(const SolutionStore &) = delete;
+  ~SolutionStore() { unmap(); }
+
+  // The part of a solution file describing a placement
+  struct PlacementRecord {
+    int piece;
+    int orientation; // Index in the orientations of the piece
+    Position pos;
+  };
+
+  bool open(const std::string &path) {
+    unmap();
+    if (!map(path)) {
+      return fail("cannot read the file");
+    }
+    if (size_ < kSolutionHeaderBytes ||
+        std::memcmp(data_, kSolutionMagic, sizeof(kSolutionMagic)) != 0) {
+      return fail("not a solution file");
+    }
+    headerBytes_ = getLittleEndian(data_ + 4, 4);
+    indexBytes_ = data_[8];
+    numPieces_ = data_[9];
+    numPlacements_ = getLittleEndian(data_ + 10, 4);
+    symmetryOrder_ = data_[14];
+    uint64_t placementsBytes =
+        uint64_t{numPlacements_} * kPlacementRecordBytes;
+    if (headerBytes_ < kSolutionHeaderBytes || headerBytes_ > size_ ||
+        indexBytes_ < 1 || indexBytes_ > 4 ||
+        placementsBytes > headerBytes_ - kSolutionHeaderBytes) {
+      return fail("bad header");
+    }
+    placements_ = data_ + headerBytes_ - placementsBytes;
+
+    const char *puzzle = reinterpret_cast<const char *>(data_);
+    std::istringstream binary(std::string(puzzle + kSolutionHeaderBytes,
+                                          puzzle + (placements_ - data_)));
+    PuzzleReader reader(binary);
+    if (!reader.next(puzzle_)) {
+      return fail("bad puzzle: " + reader.error());
+    }
+    orients_ = puzzleOrients(puzzle_, puzzle_.size);
+    if (numPieces_ != orients_.size()) {
+      return fail("bad number of pieces");
+    }
+    for (uint32_t i = 0; i < numPlacements_; ++i) {
+      PlacementRecord p = placement(i);
+      if (p.piece >= orients_.size() ||
+          p.orientation >= orients_[p.piece].size()) {
+        return fail("bad placement " + std::to_string(i));
+      }
+      const Size &size = orients_[p.piece][p.orientation].size_;
+      if (p.pos.x + size.x > puzzle_.size.x ||
+          p.pos.y + size.y > puzzle_.size.y ||
+          p.pos.z + size.z > puzzle_.size.z) {
+        return fail("placement " + std::to_string(i) + " is out of the box");
+      }
+    }
+    return true;
+  }
+
+  // Why open() failed
+  const std::string &error() const { return error_; }
+
+  // The puzzle solved, its size the box searched
+  const Puzzle &puzzle() const { return puzzle_; }
+
+  // Number of solutions, a partly written last one left out
+  uint64_t size() const {
+    return (size_ - headerBytes_) / (uint64_t(numPieces_) * indexBytes_);
+  }
+
+  uint32_t numPlacements() const { return numPlacements_; }
+
+  // 0 if the file holds every solution, else the order of the rotation
+  // group of the box that it holds one solution out of each orbit of
+  int symmetryOrder() const { return symmetryOrder_; }
+
+  PlacementRecord placement(uint32_t index) const {
+    const unsigned char *p = placements_ + index * kPlacementRecordBytes;
+    return {p[0], p[1], {p[2], p[3], p[4]}};
+  }
+
+  // Index of the i-th placement of a solution
+  uint32_t placementIndex(uint64_t solution, int i) const {
+    return getLittleEndian(data_ + headerBytes_ +
+                               (solution * numPieces_ + i) * indexBytes_,
+                           indexBytes_);
+  }
+
+  // Place the pieces of a solution in box, a box of the size of puzzle()
+  // with its blocked cells and no pieces. False if the solution is corrupt.
+  template <int N> bool decode(uint64_t solution, Box<N> &box) const {
+    for (int i = 0; i < numPieces_; ++i) {
+      uint32_t index = placementIndex(solution, i);
+      if (index >= numPlacements_) {
+        return false;
+      }
+      PlacementRecord p = placement(index);
+      const Piece &orient = orients_[p.piece][p.orientation];
+      Occupancy<N> mask = box.pieceMask(orient, p.pos);
+      if (!box.canPush(mask)) {
+        return false;
+      }
+      box.pushPiece(orient, p.pos, mask, p.piece);
+    }
+    return true;
+  }
+
+private:
+  bool map(const std::string &path) {
+#if defined(_WIN32)
+    // No mapping, read the whole file instead
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+      return false;
+    }
+    buffer_.assign(std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>());
+    data_ = reinterpret_cast<const unsigned char *>(buffer_.data());
+    size_ = buffer_.size();
+    return true;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    bool mapped = fstat(fd, &st) == 0;
+    if (mapped && st.st_size > 0) {
+      void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      mapped = data != MAP_FAILED;
+      if (mapped) {
+        data_ = static_cast<const unsigned char *>(data);
+        size_ = st.st_size;
+      }
+    }
+    ::close(fd);
+    return mapped;
+#endif
+  }
+
+  void unmap() {
+#if !defined(_WIN32)
+    if (data_) {
+      munmap(const_cast<unsigned char *>(data_), size_);
+    }
+#endif
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  bool fail(const std::string &message) {
+    error_ = message;
+    return false;
+  }
+
+  const unsigned char *data_ = nullptr;
+  uint64_t size_ = 0;
+#if defined(_WIN32)
+  std::string buffer_;
+#endif
+  uint64_t headerBytes_ = 0;
+  int indexBytes_ = 1;
+  int numPieces_ = 0;
+  uint32_t numPlacements_ = 0;
+  int symmetryOrder_ = 0;
+  const unsigned char *placements_ = nullptr;
+  Puzzle puzzle_;
+  std::vector<PieceOrients> orients_;
+  std::string error_;
+};